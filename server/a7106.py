@@ -21,6 +21,15 @@ def load_csv_regs(filename):
 
     return regs
 
+def rssi_dbm(adc):
+    """ The RSSI reading in ADC [7:0] (1Dh) to dBm, roughly """
+    # figure 17.1 in the datasheet is close to a straight line from
+    # 158 at -105 dBm to 25 at -60 dBm, and flat at about 10 from
+    # -50 dBm up, so anything stronger than that is only "strong"
+    if adc < 20:
+        return -58
+    return int(round(-60 - (adc - 25) * 45 / 133))
+
 class RxError(Exception):
     pass
 
@@ -49,6 +58,7 @@ class A7106:
         GPIO.setwarnings(True)
 
         self.regs = load_csv_regs('a7106_registers.csv')
+        self.last_rssi = None
 
         self.setup()
         self.set_channel(channel)
@@ -236,6 +246,18 @@ class A7106:
         else:
             print("id validated", val.hex())
 
+    def set_link(self, speed, fec):
+        """ Data rate, 500 Kbps / (speed + 1), and FEC, see setup() """
+        slow = speed >= 3 # 125 Kbps and below
+        self.write_reg(0x0E, speed)
+        self.write_reg(0x1F, 0b00011111 if fec else 0b00001111)
+        self.write_reg(0x20, 0b00010101 if slow else 0b00010110) # PMD = 01 up to 125 Kbps, 10 for 250/500
+        self.write_reg(0x29, 0b00100111 if slow else 0b01000111) # DCM = 01 up to 125 Kbps, 10 for 250/500
+
+    def rssi(self):
+        """ Of the last packet received in dBm, if it is known """
+        return self.last_rssi
+
     def set_packet_length(self, packet_length):
         if (packet_length > 64) or (packet_length < 1):
             raise Exception('Packet length out of range, got:{} min:1 max:64'.format(packet_length))
@@ -258,11 +280,32 @@ class A7106:
         while GPIO.input(self.pins['io2']) == GPIO.HIGH:
             pass
 
-    def blocking_receive(self):
-        """ Wait for one packet to be recevied """
+    def wake(self, data, duration):
+        """ Repeat a packet for duration seconds, to wake up a tag that is in wake on radio """
+        self.transmit(data)
+
+        # the FIFO still has the packet, so only the pointer needs
+        # resetting, which keeps the gap between them short enough
+        # for the tag's listen window
+        end = time.time() + duration
+        while time.time() < end:
+            self.strobe(0b1110) # Fifo write pointer reset
+            self.strobe(0b1101) # TX
+            while GPIO.input(self.pins['io2']) == GPIO.HIGH:
+                pass
+
+    def blocking_receive(self, timeout=None):
+        """ Wait for one packet to be recevied, or return None after timeout seconds """
         self.strobe(0b1100) # RX
+        end = None if timeout is None else time.time() + timeout
         while GPIO.input(self.pins['io2']) == GPIO.HIGH:
-            pass
+            if end is not None and time.time() > end:
+                self.strobe(0b1010) # Standby
+                return None
+
+        # ARSSI (01h) measured it while the packet came in, and it
+        # is kept in the ADC register now that it is back in standby
+        self.last_rssi = rssi_dbm(ord(self.read_reg(0x1D)))
 
         mode_reg = ord(self.read_reg(0x00))
         if mode_reg & 0b00100000:
@@ -0,0 +1,946 @@
+#!/usr/bin/env python3
+# Discrete event simulation of a fleet of tags and their gateways, for
+# working out how many tags a gateway can look after and how long a
+# rollout takes before trying it on a real store.
+#
+# The gateways are eink_server from server.py, with a radio that puts
+# their packets on a simulated channel and a time module that runs on
+# the simulated clock.  The tags are a model of the main loop and
+# check_for_updates() in src/main.c: the hellos with listen before
+# talk, bursts, deltas, broadcasts and coded blocks, the check in slots
+# timed with a VLO that is off by a different amount on each tag, the
+# link fallback and wake on radio.  Packets take their air time at
+# the link setting, are lost when they overlap another on the same
+# channel, and fade like in src/sim/air.c.
+#
+# The tags start with the first image, and the gateways move on to
+# each of the others in turn, --every seconds apart.
+#
+#   ./fleet.py --tags 1000 --gateways 2 --channels 2 hello.png price.label
+#
+import argparse
+import heapq
+import itertools
+import random
+import struct
+import server
+
+# from src/main.c and src/radio.c, in ms of the tag's VLO
+HELLO_TIMEOUT = 60
+BURST_TIMEOUT = 20
+BROADCAST_SLOTS = 64
+BROADCAST_SLOT_MS = 32
+LBT_TRIES = 5
+LBT_LISTEN_MS = 1
+LBT_SLOT_MS = 8
+WOR_WAKE_MS = 4200
+
+CHECKIN_MAX_MS = 1000000
+CHECKIN_TICKS = 256
+WDT_TICK_CYCLES = 32768
+VLO_HZ = 12000
+CHECKIN_QUIET_MAX = 3
+CHECKIN_SHIFT_MAX = 5
+CHECKIN_SOON = 1
+CHECKIN_RETRY_MAX = 8
+CHECKIN_VOLTS = [ 553, 512, 471 ]
+
+IMG_BLOCKS = 125
+IMG_SLOTS = 32
+CODED_PENDING = 120
+EPD_PARTIAL_LIMIT = 8
+
+LINK_POWER = server.LINK_LOW | server.LINK_HIGH
+
+# the wake on radio listen window and the sleep between them on the
+# radio's RC oscillator, which is trimmed to within a few percent
+WOR_SLEEP = 256 / 128
+WOR_ACTIVE = 16 / 4096
+
+# seconds for the full and the fast waveform, from src/sim/eink.c
+REFRESH_FULL = 2.0
+REFRESH_FAST = 0.4
+
+# between the end of a hello and the gateway's reply, and from the
+# strobe to the first bit of a packet
+GATEWAY_LATENCY = 0.002
+TX_SETUP = 0.0002
+
+# uA, the same figures as src/sim/energy.c.  Asleep is the MCU in
+# LPM3, the radio asleep, the flash in standby and the panel asleep.
+SLEEP_UA = 0.5 + 1.5 + 10 + 1
+RX_UA = 16000
+TX_UA = 20000
+TX_LOW_UA = 13900
+REFRESH_UA = 5000
+BATTERY_MAH = 620
+
+def airtime(rate, fec, length=40):
+	# preamble and ID, then the payload and CRC, which FEC codes 4
+	# bits in 7
+	bits = (4 + 4) * 8 + (length + 2) * 8 * (7 / 4 if fec else 1)
+	return bits / (server.LINK_KBPS[rate] * 1000)
+
+def link_dbm(link):
+	if link & server.LINK_LOW:
+		return -10
+	if link & server.LINK_HIGH:
+		return 1
+	return 0
+
+def fade(rssi, rate, fec):
+	# percent lost to noise, the same as air_fade()
+	sensitivity = -90 - 3 * [0, 1, 2, 2][rate]
+	if not fec:
+		sensitivity += 2
+	margin = rssi - sensitivity
+	if margin >= 4:
+		return 0
+	if margin <= -4:
+		return 100
+	return (4 - margin) * 100 // 8
+
+def checkin_div(ms, at):
+	# checkin_div() in main.c, which is exact in 32 bits within the range
+	if at == 0 or at >> 26 or (ms // at) >> 20:
+		return 0xFFFFFFFF
+	return (ms << 12) // at
+
+def percentile(values, p):
+	values = sorted(values)
+	return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+def busy_time(intervals, start, end):
+	# the time in [start,end) that at least one of them covers
+	total = 0
+	until = start
+	for (a, b) in sorted(intervals):
+		a = max(a, until)
+		b = min(b, end)
+		if b > a:
+			total += b - a
+			until = b
+	return total
+
+
+class Packet:
+    def __init__(self, channel, dest, data, rate, fec, dbm, start, duration=None):
+        self.channel = channel
+        self.dest = dest
+        self.data = data
+        self.rate = rate
+        self.fec = fec
+        self.dbm = dbm
+        self.start = start
+        self.frame = airtime(rate, fec)
+        # a wake up is the same packet repeated for the duration
+        self.wake = duration is not None
+        self.end = start + (duration if self.wake else self.frame)
+
+
+class Air:
+    # what is on each channel, and who is listening for it
+    def __init__(self, fleet, channels):
+        self.fleet = fleet
+        self.packets = [[] for i in range(channels)]
+        self.log = [[] for i in range(channels)]
+        self.listeners = {}
+        self.wor = {}
+        self.loss = 0
+        self.lost = 0
+        self.faded = 0
+        self.collided = 0
+
+    def add(self, p):
+        packets = self.packets[p.channel]
+        if len(packets) > 256:
+            # nothing is heard long after it ends
+            cutoff = self.fleet.now - 2 * WOR_WAKE_MS / 1000
+            packets[:] = [q for q in packets if q.end > cutoff]
+        packets.append(p)
+        self.log[p.channel].append((p.start, p.end))
+
+        listeners = self.wor if p.wake else self.listeners
+        for tag in list(listeners.get((p.channel, p.dest), ())):
+            tag.offer(p)
+
+    def listen(self, listeners, tag, channel, id, on):
+        tags = listeners.setdefault((channel, id), set())
+        if on:
+            tags.add(tag)
+        else:
+            tags.discard(tag)
+
+    def busy(self, channel, start, end, exclude=None):
+        return any(q is not exclude and q.start < end and q.end > start
+          for q in self.packets[channel])
+
+    def heard(self, p, rate, fec, atten, start=None, end=None):
+        # whether a receiver at the rate and code gets the packet, or
+        # the part of a wake up from start to end
+        if (p.rate, p.fec) != (rate, fec):
+            return False
+        if self.busy(p.channel, p.start if start is None else start, p.end if end is None else end, p):
+            self.collided += 1
+            return False
+
+        rng = self.fleet.rng
+        if rng.random() * 100 < self.loss:
+            self.lost += 1
+            return False
+        percent = fade(p.dbm - atten, rate, fec)
+        if percent and rng.randrange(100) < percent:
+            self.faded += 1
+            return False
+        return True
+
+
+class FleetTime:
+    # stands in for the time module in server.py, so that each
+    # gateway runs on its own part of the simulated time line
+    def __init__(self):
+        self.radio = None
+
+    def time(self):
+        return self.radio.t
+
+    def sleep(self, seconds):
+        self.radio.t += seconds
+
+clock = FleetTime()
+
+
+class FleetRadio:
+    # the parts of a7106.A7106 that eink_server uses
+    class RxError(Exception):
+        pass
+
+    def __init__(self, fleet, channel):
+        self.fleet = fleet
+        self.channel = channel
+        self.t = 0
+        self.id = 0
+        self.rate = 0
+        self.fec = True
+        self.last_rssi = None
+        self.sent = 0
+
+    def time(self):
+        return self.t
+
+    def set_id(self, id):
+        self.id = id
+
+    def set_link(self, speed, fec):
+        self.rate = server.LINK_SPEEDS.index(speed)
+        self.fec = fec
+
+    def rssi(self):
+        return self.last_rssi
+
+    def transmit(self, data):
+        p = Packet(self.channel, self.id, data, self.rate, self.fec, 1, self.t + TX_SETUP)
+        self.t = p.end
+        self.sent += 1
+        self.fleet.air.add(p)
+
+    def wake(self, data, duration):
+        p = Packet(self.channel, self.id, data, self.rate, self.fec, 1, self.t + TX_SETUP, duration)
+        self.t = p.end
+        self.fleet.air.add(p)
+
+
+class Gateway:
+    def __init__(self, fleet, gateway_id, group_id, channel):
+        self.fleet = fleet
+        self.channel = channel
+        self.radio = FleetRadio(fleet, channel)
+        self.server = server.eink_server(gateway_id=gateway_id, group_id=group_id, channel=channel, radio=self.radio)
+        self.id = gateway_id
+        self.free = 0 # when it is back in blocking_receive()
+        self.seq = 0
+        self.hellos = 0
+        self.deaf = 0 # hellos that arrived while it was sending
+        self.missed = 0 # lost on the way
+
+    def run(self, f, *args):
+        clock.radio = self.radio
+        f(*args)
+        clock.radio = None
+
+    def receive(self, p, atten):
+        if p.start < self.free:
+            self.deaf += 1
+            return
+        if not self.fleet.air.heard(p, 0, True, atten):
+            self.missed += 1
+            return
+
+        self.hellos += 1
+        self.seq += 1
+        self.radio.t = self.fleet.now + GATEWAY_LATENCY
+        self.radio.last_rssi = int(p.dbm - atten)
+        self.run(self.serve, p.data)
+
+    def poll(self, seq):
+        # the receive timeout, when it looks for tags to wake up
+        if seq != self.seq:
+            return
+        self.seq += 1
+        self.radio.t = self.fleet.now
+        self.run(self.serve, None)
+
+    def serve(self, data):
+        # one time round eink_server.serve()
+        if data is not None:
+            self.server.hello(data)
+            self.radio.set_link(server.LINK_SPEEDS[0], True)
+        self.server.wake()
+        self.server.report()
+        self.radio.set_id(self.id)
+
+        # only rollouts give wake() anything to do, so the time
+        # between them doesn't have to go round the sessions each second
+        self.free = self.radio.t
+        if self.fleet.rolling:
+            self.fleet.at(self.free + self.server.wake_poll, self.poll, self.seq)
+
+    def set_image(self, image):
+        self.server.set_image(*image)
+        self.seq += 1
+        self.fleet.at(max(self.free, self.fleet.now), self.poll, self.seq)
+
+
+class Tag:
+    def __init__(self, fleet, client_id, gateway, img_id, vlo, atten, boot):
+        self.fleet = fleet
+        self.id = client_id
+        self.gateway = gateway
+        self.channel = gateway.channel
+        self.atten = atten
+        self.vlo = vlo
+        self.boot = boot
+        self.tick_s = WDT_TICK_CYCLES / vlo
+        self.wor_period = (WOR_SLEEP + WOR_ACTIVE) * fleet.rng.uniform(0.97, 1.03)
+        self.voltage = int(fleet.volts * 1024 / 5)
+
+        # the image, which the tags are installed with
+        self.img_id = img_id
+        self.blocks = IMG_BLOCKS
+        self.map = 0 # bit set for each missing block
+        self.not_ready = False
+        self.template = False
+        self.need_draw = False
+        self.dirty = False
+        self.partials = 0
+        self.log = [img_id]
+        self.coded_pending = []
+
+        self.group_id = 0
+        self.link = server.LINK_BASE
+        self.link_heard = False
+        self.hello_seq = 0
+
+        self.tick_len = WDT_TICK_CYCLES * 16000 // VLO_HZ
+        self.ok_tick = 0
+        self.checkin_at = CHECKIN_TICKS << 8
+        self.checkin_period = CHECKIN_TICKS << 8
+        self.checkin_tick = 0
+        self.checkin_frac = 0
+        self.checkin_due = 0
+        self.checkin_seq = 0
+        self.checkin_quiet = 0
+        self.checkin_missed = 0
+        self.checkin_news = 0
+        self.checkin_soon = 0
+        self.retry_shift = 0
+        self.retry_tick = 0
+
+        self.wor_at = None
+        self.rx_at = None
+        self.sleeping = False
+        self.seq = 0
+        self.hellos = 0
+        self.backoffs = 0
+        self.done = {}
+
+        # seconds in each of the states that cost more than sleeping
+        self.tx_s = 0
+        self.tx_low_s = 0
+        self.rx_s = 0
+        self.refresh_s = 0
+
+        self.proc = self.main()
+        fleet.at(boot, self.resume, self.seq, None)
+
+    # the simulation side: each step of main() yields what the tag
+    # waits for, and is resumed with the result when it happens
+    def resume(self, seq, value):
+        if seq != self.seq:
+            return
+        self.seq += 1
+        self.sleeping = False
+        cmd = self.proc.send(value)
+        getattr(self, 'do_' + cmd[0])(*cmd[1:])
+
+    def later(self, seconds, value=None):
+        self.fleet.at(self.fleet.now + seconds, self.resume, self.seq, value)
+
+    def ms(self, ms):
+        # a wait in ms on the VLO, which assumes that it is at 12 kHz
+        return ms * VLO_HZ / self.vlo / 1000
+
+    def timer(self):
+        return int((self.fleet.now - self.boot) / self.tick_s + 1e-9)
+
+    def do_wait(self, seconds):
+        self.later(seconds)
+
+    def do_tick(self, tick):
+        # asleep in LPM3 until the watchdog tick, unless woken up
+        self.fleet.at(self.boot + tick * self.tick_s, self.resume, self.seq, None)
+        self.sleeping = True
+        if self.wor_at is not None:
+            for p in self.fleet.air.packets[self.channel]:
+                if p.wake and p.dest == self.wake_id() and p.end > self.fleet.now:
+                    self.offer(p)
+
+    def do_lbt(self):
+        seconds = self.ms(LBT_LISTEN_MS)
+        self.rx_s += seconds
+        self.fleet.at(self.fleet.now + seconds, self.lbt_end, self.seq, self.fleet.now)
+
+    def lbt_end(self, seq, start):
+        if seq == self.seq:
+            self.resume(seq, self.fleet.air.busy(self.channel, start, self.fleet.now))
+
+    def do_tx(self, dest, data, link):
+        p = Packet(self.channel, dest, data, 0, True, link_dbm(link), self.fleet.now + TX_SETUP)
+        if link & server.LINK_LOW:
+            self.tx_low_s += p.end - self.fleet.now
+        else:
+            self.tx_s += p.end - self.fleet.now
+        self.fleet.air.add(p)
+        self.fleet.at(p.end, self.tx_end, self.seq, p)
+
+    def tx_end(self, seq, p):
+        for gateway in self.fleet.gateways:
+            if gateway.channel == p.channel and gateway.id == p.dest:
+                gateway.receive(p, self.atten)
+        self.resume(seq, None)
+
+    def do_rx(self, id, link, timeout):
+        self.rx_id = id
+        self.rx_rate = link & server.LINK_RATE
+        self.rx_fec = (link & server.LINK_NOFEC) == 0
+        self.rx_at = self.rx_after = self.fleet.now
+        self.rx_until = self.fleet.now + timeout
+        self.rx_next = None
+        self.fleet.air.listen(self.fleet.air.listeners, self, self.channel, id, True)
+        for p in self.fleet.air.packets[self.channel]:
+            if not p.wake and p.dest == id:
+                self.offer(p)
+        self.fleet.at(self.rx_until, self.rx_end, self.seq, None)
+
+    def offer(self, p):
+        # a packet for an id that we are listening on
+        now = self.fleet.now
+        if p.wake:
+            # the first wake on radio window that it is all over
+            if self.wor_at is None or not self.sleeping:
+                return
+            start = max(p.start, now)
+            k = max(0, -int((self.wor_at + WOR_SLEEP - start) // self.wor_period))
+            w = self.wor_at + WOR_SLEEP + k * self.wor_period
+            if w + p.frame <= p.end:
+                self.fleet.at(w + p.frame, self.wor_end, self.seq, p, w)
+            return
+
+        # the first one that starts while the receiver is on
+        if p.start < self.rx_after or p.start >= self.rx_until \
+        or (self.rx_next is not None and p.start >= self.rx_next.start):
+            return
+        self.rx_next = p
+        self.fleet.at(p.end, self.rx_end, self.seq, p)
+
+    def rx_end(self, seq, p):
+        if seq != self.seq or p is not self.rx_next:
+            return
+        if p is not None and not self.fleet.air.heard(p, self.rx_rate, self.rx_fec, self.atten):
+            # keep listening for the next one
+            self.rx_after = p.start + 1e-9
+            self.rx_next = None
+            for q in self.fleet.air.packets[self.channel]:
+                if not q.wake and q.dest == self.rx_id:
+                    self.offer(q)
+            if self.rx_next is not None or self.fleet.now < self.rx_until:
+                return
+            p = None
+
+        self.fleet.air.listen(self.fleet.air.listeners, self, self.channel, self.rx_id, False)
+        self.rx_s += self.fleet.now - self.rx_at
+        self.resume(seq, p.data if p is not None else None)
+
+    def wor_end(self, seq, p, w):
+        if seq != self.seq or self.wor_at is None:
+            return
+        if self.fleet.air.heard(p, 0, True, self.atten, w, w + p.frame):
+            self.wor_off()
+            self.resume(seq, p.data)
+            return
+        w += self.wor_period
+        if w + p.frame <= p.end:
+            self.fleet.at(w + p.frame, self.wor_end, seq, p, w)
+
+    def wake_id(self):
+        return self.group_id or self.id
+
+    def wor(self):
+        self.wor_at = self.fleet.now
+        self.wor_id = self.wake_id()
+        self.fleet.air.listen(self.fleet.air.wor, self, self.channel, self.wor_id, True)
+
+    def wor_windows(self):
+        # listen windows since the last radio_wor()
+        if self.wor_at is None:
+            return 0
+        return max(int((self.fleet.now - self.wor_at - WOR_SLEEP) // self.wor_period) + 1, 0)
+
+    def wor_off(self):
+        # the radio is woken up for something else, which stops the
+        # listen windows until the next radio_wor()
+        if self.wor_at is None:
+            return
+        self.rx_s += self.wor_windows() * WOR_ACTIVE
+        self.fleet.air.listen(self.fleet.air.wor, self, self.channel, self.wor_id, False)
+        self.wor_at = None
+
+    def energy(self, seconds):
+        # average uA over the time since it was installed
+        rx_s = self.rx_s + self.wor_windows() * WOR_ACTIVE
+        uas = SLEEP_UA * seconds + TX_UA * self.tx_s + TX_LOW_UA * self.tx_low_s \
+          + RX_UA * rx_s + REFRESH_UA * self.refresh_s
+        return uas / seconds
+
+    # the tag side, following src/main.c
+    def main(self):
+        self.checkin_next()
+        while (yield from self.check_for_updates()):
+            pass
+        self.wor()
+
+        while True:
+            if not self.not_ready and self.need_draw:
+                yield from self.img_draw()
+
+            tick = self.retry_tick if self.not_ready else self.checkin_tick
+            if self.timer() < tick:
+                woken = yield ('tick', tick)
+                if woken is not None:
+                    yield from self.img_woken(woken)
+                    self.wor()
+                continue
+
+            if not self.not_ready:
+                if self.checkin_soon:
+                    self.checkin_soon = 0
+                else:
+                    if self.checkin_frac:
+                        self.wor_off()
+                        yield ('wait', self.ms(self.checkin_frac * (WDT_TICK_CYCLES // 256) // (VLO_HZ // 1000)))
+                    self.checkin_due = 1
+
+            while (yield from self.check_for_updates()):
+                pass
+
+            if self.checkin_due:
+                self.checkin_due = 0
+                self.checkin_miss()
+            elif self.timer() >= self.checkin_tick:
+                self.checkin_next()
+
+            if self.not_ready:
+                self.retry_tick = self.timer() + (1 << self.retry_shift)
+                if self.retry_shift < CHECKIN_RETRY_MAX:
+                    self.retry_shift += 1
+
+            self.wor()
+
+    def checkin_next(self):
+        self.checkin_tick = self.ok_tick + (self.checkin_at >> 8)
+        self.checkin_frac = self.checkin_at & 0xFF
+
+    def checkin_shift(self):
+        shift = self.checkin_quiet + len([v for v in CHECKIN_VOLTS if self.voltage < v])
+        return min(shift, CHECKIN_SHIFT_MAX)
+
+    def checkin_miss(self):
+        self.checkin_at += self.checkin_period << self.checkin_missed
+        if self.checkin_missed < CHECKIN_SHIFT_MAX:
+            self.checkin_missed += 1
+        self.checkin_next()
+
+    def checkin_schedule(self, slot_ms, elapsed_ms, period, seq, flags):
+        self.ok_tick = self.timer()
+        if self.checkin_due and seq == (self.checkin_seq + 1) & 0xFF and elapsed_ms != 0:
+            length = checkin_div(elapsed_ms, self.checkin_at)
+            if 16000 < length < 160000:
+                self.tick_len = length
+
+        queued = flags & server.OK_FLAG_QUEUED
+        if self.checkin_news or queued:
+            self.checkin_quiet = 0
+        elif self.checkin_due and self.checkin_quiet < CHECKIN_QUIET_MAX:
+            self.checkin_quiet += 1
+
+        self.checkin_seq = seq
+        self.checkin_due = 0
+        self.checkin_news = 0
+        self.checkin_missed = 0
+
+        if slot_ms == 0 or slot_ms >= CHECKIN_MAX_MS or period * 1000 >= CHECKIN_MAX_MS:
+            self.checkin_at = self.checkin_period = CHECKIN_TICKS << 8
+        else:
+            self.checkin_at = ((slot_ms << 12) // self.tick_len) & 0xFFFFFFFF
+            self.checkin_period = ((period * 1000) << 12) // self.tick_len
+        self.checkin_at += (self.checkin_period << self.checkin_shift()) - self.checkin_period
+        self.checkin_next()
+
+        self.checkin_soon = queued
+        if queued:
+            self.checkin_tick = self.ok_tick + CHECKIN_SOON
+            self.checkin_frac = 0
+            self.retry_shift = 0
+            self.retry_tick = self.checkin_tick
+
+    def radio_tx(self, dest, data, link):
+        self.wor_off()
+        for i in range(LBT_TRIES):
+            if not (yield ('lbt',)):
+                break
+            self.backoffs += 1
+            slots = 1 + (self.fleet.rng.getrandbits(16) & ((2 << i) - 1))
+            yield ('wait', self.ms(slots * LBT_SLOT_MS))
+        yield ('tx', dest, data, link)
+
+    def check_for_updates_rx(self):
+        self.hello_seq += 1
+        flags = server.HELLO_FLAG_BURST | server.HELLO_FLAG_DELTA | server.HELLO_FLAG_RLE \
+          | server.HELLO_FLAG_WOR | server.HELLO_FLAG_DRAW | server.HELLO_FLAG_TEMPLATE \
+          | server.HELLO_FLAG_CODED | (server.HELLO_FLAG_GROUP if self.group_id else 0) \
+          | self.link << 8 | (self.hello_seq & 7) << 13
+        hello = struct.pack('<IIIIHHI', 0, self.id, 0, 0, self.voltage, flags, self.img_id) \
+          + self.map.to_bytes(16, 'little')
+
+        self.hellos += 1
+        yield from self.radio_tx(self.gateway.id, hello, self.link & LINK_POWER)
+        self.link_heard = False
+        return (yield from self.img_rx(self.id, self.ms(HELLO_TIMEOUT), self.link))
+
+    def check_for_updates(self):
+        again = yield from self.check_for_updates_rx()
+        if not self.link_heard and self.link != server.LINK_SAFE:
+            self.link = server.LINK_SAFE
+            again = yield from self.check_for_updates_rx()
+        return again
+
+    def img_rx(self, id, timeout, link):
+        got = False
+        while True:
+            data = yield ('rx', id, link, timeout)
+            if data is None:
+                return got
+            timeout = self.ms(BURST_TIMEOUT)
+            got = True
+            self.link_heard = True
+
+            (img_id, offset, flags) = struct.unpack('<IHH', data[0:8])
+            if flags & server.REPLY_FLAG_WAKE:
+                self.checkin_news = 1
+                yield ('wait', self.ms(WOR_WAKE_MS))
+                return True
+
+            if flags & server.REPLY_FLAG_OK:
+                (group_id, slot_ms, elapsed_ms, period, seq, link, ok_flags) = \
+                  struct.unpack('<IIIHBBB', data[8:27])
+                if flags & server.REPLY_FLAG_GROUP:
+                    self.group_id = group_id
+                self.link = link & (server.LINK_RATE | server.LINK_NOFEC | LINK_POWER)
+                self.checkin_schedule(slot_ms, elapsed_ms, period, seq, ok_flags)
+                return False
+
+            self.checkin_news = 1
+            self.retry_shift = 0
+
+            if flags & server.REPLY_FLAG_DELTA:
+                self.img_delta(img_id, flags, data[8:])
+                return True
+
+            self.img_store(img_id, offset, flags)
+            if not (flags & server.REPLY_FLAG_MORE) or not self.not_ready:
+                return True
+
+    def img_woken(self, data):
+        (img_id, offset, flags, dest) = struct.unpack('<IHHI', data[0:12])
+        if dest != self.id and dest != server.WAKE_ALL:
+            return
+
+        broadcast = (flags & server.REPLY_FLAG_GROUP) \
+          and (img_id != self.img_id or self.not_ready)
+        yield ('wait', self.ms(WOR_WAKE_MS))
+
+        if broadcast:
+            yield from self.img_rx(self.group_id, self.ms(HELLO_TIMEOUT), server.LINK_BASE)
+            slot = (self.id ^ (self.id >> 16)) % BROADCAST_SLOTS
+            yield ('wait', self.ms((slot + 1) * BROADCAST_SLOT_MS))
+
+        while (yield from self.check_for_updates()):
+            pass
+
+    def img_draw(self):
+        if self.template:
+            self.need_draw = False
+            return
+        if self.dirty and self.partials < EPD_PARTIAL_LIMIT:
+            seconds = REFRESH_FAST
+            self.partials += 1
+        else:
+            seconds = REFRESH_FULL
+            self.partials = 0
+        self.refresh_s += seconds
+        self.need_draw = False
+        yield ('wait', seconds)
+
+    def img_start_reply(self, img_id, flags):
+        # returns the number of blocks, or 0 if it was in the log
+        if img_id in self.log:
+            self.img_id = img_id
+            self.map = 0
+            self.not_ready = False
+            self.need_draw = True
+            self.dirty = False
+            self.log.remove(img_id)
+            self.log.append(img_id)
+            self.fleet.complete(self)
+            return 0
+
+        blocks = IMG_BLOCKS
+        formats = server.REPLY_FLAG_RLE | server.REPLY_FLAG_DRAW | server.REPLY_FLAG_TEMPLATE
+        if (flags & formats) and (flags >> 8) <= IMG_BLOCKS:
+            blocks = flags >> 8
+
+        self.img_id = img_id
+        self.blocks = blocks
+        self.map = (1 << blocks) - 1
+        self.not_ready = True
+        self.template = (flags & server.REPLY_FLAG_TEMPLATE) != 0
+        self.dirty = False
+        self.coded_pending = []
+        return blocks
+
+    def img_check_complete(self):
+        if self.map != 0:
+            self.not_ready = True
+            return
+        if not self.not_ready:
+            return
+        self.not_ready = False
+        self.need_draw = True
+        if self.img_id in self.log:
+            self.log.remove(self.img_id)
+        self.log = self.log[-(IMG_SLOTS - 1):] + [self.img_id]
+        self.fleet.complete(self)
+
+    def img_delta(self, img_id, flags, payload):
+        (base_id,) = struct.unpack('<I', payload[0:4])
+        changed = int.from_bytes(payload[4:20], 'little')
+        if base_id not in self.log:
+            return
+        if not self.img_start_reply(img_id, flags):
+            return
+        self.map &= changed
+        self.dirty = True
+        self.img_check_complete()
+
+    def coded_missing(self, seed):
+        return [i for i in server.coded_set(seed, self.blocks) if self.map & (1 << i)]
+
+    def img_coded(self, seed):
+        missing = self.coded_missing(seed)
+        if len(missing) <= 1:
+            if missing:
+                self.map &= ~(1 << missing[0])
+            return
+        if len(self.coded_pending) < CODED_PENDING:
+            self.coded_pending.append(seed)
+
+    def img_store(self, img_id, offset, flags):
+        coded = (offset & server.REPLY_OFFSET_CODED) != 0
+        if not coded and (offset >= IMG_BLOCKS * server.BLOCK_SIZE or offset % server.BLOCK_SIZE):
+            return
+        if img_id != self.img_id and not self.img_start_reply(img_id, flags):
+            return
+
+        if coded:
+            self.img_coded(offset & ~server.REPLY_OFFSET_CODED)
+        elif self.map & (1 << (offset // server.BLOCK_SIZE)):
+            self.map &= ~(1 << (offset // server.BLOCK_SIZE))
+        else:
+            return
+
+        self.img_check_complete()
+
+        # each decoded block can free up the rest of another set
+        progress = True
+        while progress and self.not_ready and self.coded_pending:
+            progress = False
+            for seed in list(self.coded_pending):
+                missing = self.coded_missing(seed)
+                if len(missing) > 1:
+                    continue
+                if missing:
+                    self.map &= ~(1 << missing[0])
+                self.coded_pending.remove(seed)
+                progress = True
+                self.img_check_complete()
+
+
+class Fleet:
+    def __init__(self, args):
+        self.rng = random.Random(args.seed)
+        self.now = 0
+        self.events = []
+        self.count = itertools.count()
+        self.volts = args.volts
+        self.air = Air(self, args.channels)
+        self.air.loss = args.loss
+
+        self.images = [server.load_image(filename) for filename in args.image]
+        self.names = args.image
+        self.rollouts = []
+        self.rolling = False
+
+        self.gateways = []
+        for i in range(args.gateways):
+            gateway_id = 0xaed8e4fd if i == 0 else (5 << 28) | self.rng.getrandbits(28)
+            group_id = 0xafcd613d if i == 0 else (5 << 28) | self.rng.getrandbits(28)
+            gateway = Gateway(self, gateway_id, group_id, i % args.channels)
+            gateway.run(gateway.server.set_image, *self.images[0])
+            self.gateways.append(gateway)
+
+        # installed over the first period, so they are spread out
+        # before the gateways give them slots
+        (atten_min, atten_max) = args.atten
+        (vlo_min, vlo_max) = args.vlo
+        self.tags = []
+        for i in range(args.tags):
+            tag = Tag(self, (5 << 28) | self.rng.getrandbits(28),
+              self.gateways[i % args.gateways], self.images[0][1],
+              self.rng.uniform(vlo_min, vlo_max),
+              self.rng.uniform(atten_min, atten_max),
+              self.rng.uniform(0, self.gateways[0].server.slot_period))
+            self.tags.append(tag)
+
+        for (i, image) in enumerate(self.images[1:]):
+            self.at(args.start + i * args.every, self.release, image)
+
+    def at(self, t, f, *args):
+        heapq.heappush(self.events, (t, next(self.count), f, args))
+
+    def run(self, until):
+        while self.events and self.events[0][0] <= until:
+            (t, _, f, args) = heapq.heappop(self.events)
+            self.now = t
+            f(*args)
+        self.now = until
+
+    def release(self, image):
+        self.rollouts.append({ 'img_id': image[1], 'at': self.now, 'done': {}, 'end': None })
+        self.rolling = True
+        for gateway in self.gateways:
+            gateway.run(gateway.set_image, image)
+
+    def complete(self, tag):
+        # the tag has all of an image, which is what a rollout is
+        # waiting for if it is the one that the gateway is sending
+        if not self.rollouts:
+            return
+        rollout = self.rollouts[-1]
+        if tag.img_id != rollout['img_id'] or tag.id in rollout['done']:
+            return
+        rollout['done'][tag.id] = self.now - rollout['at']
+        if len(rollout['done']) == len(self.tags):
+            rollout['end'] = self.now
+            self.rolling = False
+
+    def report(self, seconds):
+        print('%d tags %d gateways %d channels %.1f hours' % (
+          len(self.tags), len(self.gateways), len(self.air.log), seconds / 3600))
+
+        hellos = sum(tag.hellos for tag in self.tags)
+        print('hellos %d heard %d deaf %d missed %d backoffs %d' % (
+          hellos, sum(g.hellos for g in self.gateways),
+          sum(g.deaf for g in self.gateways), sum(g.missed for g in self.gateways),
+          sum(tag.backoffs for tag in self.tags)))
+        print('packets lost %d faded %d collided %d' % (self.air.lost, self.air.faded, self.air.collided))
+
+        for gateway in self.gateways:
+            s = gateway.server
+            sessions = s.sessions.values()
+            errors = [abs(x.slot_error) for x in sessions if x.slot_error is not None]
+            print('gateway %08x channel %d: tags %d packets %d blocks %d broadcasts %d blocks %d slots %d/%d off %.2f fallbacks %d' % (
+              gateway.id, gateway.channel, len(sessions), gateway.radio.sent,
+              sum(x.blocks_sent for x in sessions), s.broadcasts, s.broadcast_blocks,
+              len(s.slots), int(s.slot_period / s.slot_time),
+              max(errors) if errors else 0, s.link_fallbacks))
+
+        for (i, rollout) in enumerate(self.rollouts):
+            done = list(rollout['done'].values())
+            end = rollout['end'] if rollout['end'] is not None else seconds
+            line = 'rollout %s at %.0f: %d/%d' % (self.names[i + 1], rollout['at'], len(done), len(self.tags))
+            if done:
+                line += ' in %.1f s, latency p50 %.1f p90 %.1f p99 %.1f s' % (
+                  max(done), percentile(done, 50), percentile(done, 90), percentile(done, 99))
+            busy = [busy_time(log, rollout['at'], end) / max(end - rollout['at'], 1e-9) for log in self.air.log]
+            print(line + ', airtime %s' % (' '.join('%.1f%%' % (b * 100) for b in busy)))
+
+        busy = [busy_time(log, 0, seconds) / seconds for log in self.air.log]
+        print('airtime %s' % (' '.join('%.2f%%' % (b * 100) for b in busy)))
+
+        ua = [tag.energy(max(seconds - tag.boot, 1)) for tag in self.tags]
+        days = [BATTERY_MAH * 1000 / x / 24 for x in ua]
+        print('tag avg uA p50 %.1f p90 %.1f max %.1f, CR2450 days p50 %.0f p10 %.0f min %.0f' % (
+          percentile(ua, 50), percentile(ua, 90), max(ua),
+          percentile(days, 50), percentile(days, 10), min(days)))
+
+def range_arg(text):
+	(a, _, b) = text.partition('-')
+	return (float(a), float(b or a))
+
+if __name__ == "__main__":
+	parser = argparse.ArgumentParser(description='Simulate a fleet of tags and gateways')
+	parser.add_argument('--tags', type=int, default=100, help='Number of tags')
+	parser.add_argument('--gateways', type=int, default=1, help='Number of gateways, which the tags are shared between')
+	parser.add_argument('--channels', type=int, default=1, help='Channels that the gateways are spread over')
+	parser.add_argument('--hours', type=float, default=4, help='Simulated time')
+	parser.add_argument('--start', type=float, default=3600, help='Seconds until the second image is sent')
+	parser.add_argument('--every', type=float, default=3600, help='Seconds between each of the images after that')
+	parser.add_argument('--loss', type=float, default=0, help='Percent of packets lost at random')
+	parser.add_argument('--atten', type=range_arg, default=(60, 85), help='Range of path loss in dB to the tags')
+	parser.add_argument('--vlo', type=range_arg, default=(9000, 15000), help='Range of VLO frequencies in Hz')
+	parser.add_argument('--volts', type=float, default=3.0, help='Battery voltage of the tags')
+	parser.add_argument('--seed', type=int, default=1, help='Random seed, runs repeat for the same one')
+	parser.add_argument('--verbose', action='store_true', help='Print what the gateways are doing')
+	parser.add_argument('image', nargs='*', default=['hello.png', 'price.label'], help='Image the tags start with, then the ones to send them')
+	args = parser.parse_args()
+
+	# the gateways print on the simulated clock, or not at all
+	server.time = clock
+	if args.verbose:
+		server.now = lambda: '%10.3f' % (clock.time())
+	else:
+		server.print = lambda *args, **kwargs: None
+
+	fleet = Fleet(args)
+	fleet.run(args.hours * 3600)
+	fleet.report(args.hours * 3600)
@@ -0,0 +1,282 @@
+#!/usr/bin/env python3
+# Display lists for tags that render their own labels, see src/draw.h.
+#
+# A .label file has one command per line, with coordinates in pixels
+# from the top left of the 128x250 label:
+#
+#   text X Y SCALE COLOR string...
+#   rect X Y W H COLOR
+#   line X0 Y0 X1 Y1 COLOR
+#   blit IMAGE SX SY W H X Y
+#   template TEMPLATE.template
+#   field NAME string...
+#
+# COLOR is black, white or invert.  Blits copy from an image that the
+# tag already has, which the gateway sends first, and they are byte
+# aligned: SX, W and X are multiples of 8.
+#
+# A .template file is a layout that is stored on the tag once, so that
+# labels that use it only have to send the text of its fields:
+#
+#   image IMAGE
+#   field NAME X Y W SCALE COLOR left|right|center
+import os
+import re
+import struct
+
+DRAW_END = 0x00
+DRAW_RECT = 0x01
+DRAW_LINE = 0x02
+DRAW_TEXT = 0x03
+DRAW_BLIT = 0x04
+DRAW_TEMPLATE = 0x05
+DRAW_FIELD = 0x06
+
+COLORS = { 'black': 0, 'white': 1, 'invert': 2 }
+ALIGN = { 'left': 0, 'right': 1, 'center': 2 }
+
+WIDTH = 128
+HEIGHT = 250
+STRIDE = WIDTH // 8
+
+FONT_WIDTH = 6
+FONT_HEIGHT = 8
+
+# the field table is the first block of a template
+TEMPLATE_FIELDS = 5
+TEMPLATE_TABLE = 32
+
+class Label:
+    # what the tags are sent for a .label or .template file,
+    # instead of the bitmap that they render to
+    def __init__(self):
+        self.dl = None # display list of a label
+        self.template = None # field table and compressed bitmap of a template
+        self.name = None # of a template, from the file name
+        self.fields = [] # names of the fields of a template
+        self.uses_template = False
+
+        # (bitmap, Label or None) of the images that the list draws
+        # from by id, which the tag has to have first
+        self.deps = {}
+
+def load_font():
+	# the same 5x7 font that the firmware is built with
+	filename = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'src', 'font.c')
+	font = {}
+	for line in open(filename):
+		m = re.match(r"\s*\['(\\.|.)' - 0x20\] = \{(.*)\},", line)
+		if m is None:
+			continue
+		c = m.group(1)[-1]
+		font[ord(c)] = [int(v, 16) for v in m.group(2).split(',')]
+	return font
+
+font = load_font()
+
+def fill(tpl_id, tpl, values):
+	# the display list for a template with the text of some of its
+	# fields, which is all that has to be sent for a price change
+	dl = struct.pack("<BI", DRAW_TEMPLATE, tpl_id)
+	for (name, text) in values.items():
+		text = text.encode('ascii')
+		dl += struct.pack("<BBB", DRAW_FIELD, tpl.fields.index(name), len(text)) + text
+	return dl
+
+def parse(filename, load_image):
+	# returns the Label for a .label file, load_image() is used for
+	# the images and templates that it draws from
+	lbl = Label()
+	dl = b''
+	tpl = None
+	for line in open(filename):
+		words = line.split()
+		if len(words) == 0 or words[0].startswith('#'):
+			continue
+		cmd = words[0]
+		if cmd == 'text':
+			text = line.split(None, 5)[5].rstrip('\n').encode('ascii')
+			(x, y, scale) = [int(v) for v in words[1:4]]
+			dl += struct.pack("<BBBBBB", DRAW_TEXT, x, y, scale, COLORS[words[4]], len(text)) + text
+		elif cmd == 'rect':
+			dl += struct.pack("<BBBBBB", DRAW_RECT, *[int(v) for v in words[1:5]], COLORS[words[5]])
+		elif cmd == 'line':
+			dl += struct.pack("<BBBBBB", DRAW_LINE, *[int(v) for v in words[1:5]], COLORS[words[5]])
+		elif cmd == 'blit':
+			(sx, sy, w, h, x, y) = [int(v) for v in words[2:8]]
+			if sx % 8 or w % 8 or x % 8:
+				raise ValueError("%s: blits have to be byte aligned" % (filename))
+			(img, img_id, dep) = load_image(os.path.join(os.path.dirname(filename), words[1]))
+			lbl.deps[img_id] = (img, dep)
+			dl += struct.pack("<BIBBBBBB", DRAW_BLIT, img_id, sx // 8, sy, w // 8, h, x // 8, y)
+		elif cmd == 'template':
+			(img, tpl_id, tpl) = load_image(os.path.join(os.path.dirname(filename), words[1]))
+			if tpl is None or tpl.template is None:
+				raise ValueError("%s: %s is not a template" % (filename, words[1]))
+			lbl.deps[tpl_id] = (img, tpl)
+			lbl.uses_template = True
+			dl += fill(tpl_id, tpl, {})
+		elif cmd == 'field':
+			if tpl is None:
+				raise ValueError("%s: field before the template" % (filename))
+			text = line.split(None, 2)[2].rstrip('\n')
+			dl += fill(tpl_id, tpl, { words[1]: text })[5:]
+		else:
+			raise ValueError("%s: unknown command '%s'" % (filename, cmd))
+
+	lbl.dl = dl + bytes([DRAW_END])
+	return lbl
+
+def parse_template(filename, load_image, rle_encode):
+	# returns the bitmap and Label for a .template file
+	lbl = Label()
+	table = b''
+	img = None
+	for line in open(filename):
+		words = line.split()
+		if len(words) == 0 or words[0].startswith('#'):
+			continue
+		cmd = words[0]
+		if cmd == 'image':
+			img = load_image(os.path.join(os.path.dirname(filename), words[1]))[0]
+		elif cmd == 'field':
+			(x, y, w, scale) = [int(v) for v in words[2:6]]
+			table += struct.pack("<BBBBBB", x, y, w, scale, COLORS[words[6]], ALIGN[words[7]])
+			lbl.fields.append(words[1])
+		else:
+			raise ValueError("%s: unknown command '%s'" % (filename, cmd))
+
+	if img is None:
+		raise ValueError("%s: no image" % (filename))
+	if len(lbl.fields) > TEMPLATE_FIELDS:
+		raise ValueError("%s: only %d fields" % (filename, TEMPLATE_FIELDS))
+
+	# the tag decodes the bitmap a row at a time, so it is compressed
+	rle = rle_encode(img)
+	if rle is None:
+		raise ValueError("%s: the image does not compress" % (filename))
+
+	table = struct.pack("<BB", len(lbl.fields), 0) + table
+	lbl.template = table + bytes(TEMPLATE_TABLE - len(table)) + rle
+	return (img, lbl)
+
+def span(row, x0, x1, color):
+	for x in range(max(x0, 0), min(x1, WIDTH - 1) + 1):
+		bit = 0x80 >> (x & 7)
+		if color == 0:
+			row[x >> 3] &= ~bit
+		elif color == 1:
+			row[x >> 3] |= bit
+		else:
+			row[x >> 3] ^= bit
+
+def cdiv(a, b):
+	# C division, which rounds towards zero
+	q = abs(a) // abs(b)
+	return q if (a < 0) == (b < 0) else -q
+
+def line_x(x0, y0, x1, y1, y):
+	return x0 + cdiv((x1 - x0) * (y - y0), y1 - y0)
+
+def chars(row, y, x, y0, scale, color, text):
+	if scale == 0 or y < y0 or (y - y0) // scale >= FONT_HEIGHT:
+		return
+	bit = (y - y0) // scale
+	for (j, c) in enumerate(text):
+		glyph = font.get(c, font[ord('?')])
+		for col in range(FONT_WIDTH):
+			if glyph[col] & (1 << bit):
+				px = x + (j * FONT_WIDTH + col) * scale
+				span(row, px, px + scale - 1, color)
+
+def render_row(dl, deps, y):
+	# the same as draw_row() in the firmware
+	row = bytearray([0xFF] * STRIDE)
+	fields = None
+	i = 0
+	while i < len(dl):
+		cmd = dl[i]
+		if cmd == DRAW_RECT:
+			(x0, y0, w, h, color) = dl[i+1:i+6]
+			i += 6
+			if y0 <= y < y0 + h and w != 0:
+				span(row, x0, x0 + w - 1, color)
+		elif cmd == DRAW_LINE:
+			(x0, y0, x1, y1, color) = dl[i+1:i+6]
+			i += 6
+			if y0 > y1:
+				(x0, y0, x1, y1) = (x1, y1, x0, y0)
+			if y < y0 or y > y1:
+				continue
+			if y0 == y1:
+				span(row, min(x0, x1), max(x0, x1), color)
+				continue
+			xa = line_x(x0, y0, x1, y1, y)
+			xb = xa if y == y1 else line_x(x0, y0, x1, y1, y + 1)
+			if xb > xa:
+				xb -= 1
+			elif xb < xa:
+				xb += 1
+			span(row, min(xa, xb), max(xa, xb), color)
+		elif cmd == DRAW_TEXT:
+			(x, y0, scale, color, n) = dl[i+1:i+6]
+			chars(row, y, x, y0, scale, color, dl[i+6:i+6+n])
+			i += 6 + n
+		elif cmd == DRAW_BLIT:
+			(img_id, sx, sy, w, h, dx, dy) = struct.unpack("<IBBBBBB", dl[i+1:i+11])
+			i += 11
+			src_y = sy + y - dy
+			if y < dy or y >= dy + h or src_y >= HEIGHT or sx >= STRIDE or dx >= STRIDE:
+				continue
+			w = min(w, STRIDE - sx, STRIDE - dx)
+			if img_id not in deps:
+				continue
+			# bitmaps are stored bottom row first
+			offset = (HEIGHT - 1 - src_y) * STRIDE + sx
+			row[dx:dx+w] = deps[img_id][0][offset:offset+w]
+		elif cmd == DRAW_TEMPLATE:
+			(img_id,) = struct.unpack("<I", dl[i+1:i+5])
+			i += 5
+			fields = None
+			if img_id not in deps:
+				continue
+			(img, tpl) = deps[img_id]
+			offset = (HEIGHT - 1 - y) * STRIDE
+			row[:] = img[offset:offset+STRIDE]
+			fields = tpl.template[2:TEMPLATE_TABLE]
+		elif cmd == DRAW_FIELD:
+			(n, length) = dl[i+1:i+3]
+			text = dl[i+3:i+3+length]
+			i += 3 + length
+			(x, y0, w, scale, color, align) = (0,) * 6
+			if fields is not None and n < TEMPLATE_FIELDS:
+				(x, y0, w, scale, color, align) = fields[n*6:n*6+6]
+			space = w - length * FONT_WIDTH * scale
+			if align == ALIGN['right']:
+				x += space
+			elif align == ALIGN['center']:
+				x += cdiv(space, 2)
+			chars(row, y, x, y0, scale, color, text)
+		else:
+			break
+	return bytes(row)
+
+def render(dl, deps):
+	# the bitmap that the tag draws for a list, bottom row first
+	# like the images, given the images that it draws from
+	return b''.join(render_row(dl, deps, y) for y in range(HEIGHT - 1, -1, -1))
+
+if __name__ == "__main__":
+	import argparse
+	from PIL import Image
+	import server
+
+	parser = argparse.ArgumentParser(description='Render a display list the way the tags do')
+	parser.add_argument('label', help='.label or .template file')
+	parser.add_argument('output', help='image to write')
+	args = parser.parse_args()
+
+	(img, img_id, lbl) = server.load_image(args.label)
+	stream = lbl.dl if lbl.dl is not None else lbl.template
+	print("%s: %08x %d bytes" % (args.label, img_id, len(stream)))
+	Image.frombytes('1', (WIDTH, HEIGHT), img).transpose(Image.FLIP_TOP_BOTTOM).save(args.output)
@@ -1,4 +1,4 @@
-import a7106
+import math
 import struct
 import time
 import hashlib
@@ -6,80 +6,856 @@ import os
 from PIL import Image, ImageFont, ImageDraw, ImageOps
 from threading import Thread
 from datetime import datetime
+import label
 
 def now():
     return datetime.now().strftime("%Y%M%d-%H%M%S")
 
+# the tag can stay in RX for a burst of data packets
+HELLO_FLAG_BURST = 1
+# the tag can build a new image from its current one
+HELLO_FLAG_DELTA = 2
+# the tag can decode compressed images
+HELLO_FLAG_RLE = 4
+# the tag listens for wake ups between check ins
+HELLO_FLAG_WOR = 8
+# the tag can render display lists
+HELLO_FLAG_DRAW = 16
+# the tag can store templates and fill in their fields
+HELLO_FLAG_TEMPLATE = 32
+# the tag listens for wake ups on the group ID it was given
+HELLO_FLAG_GROUP = 64
+# the tag can decode coded blocks
+HELLO_FLAG_CODED = 128
+
+REPLY_FLAG_OK = 1 # image is complete, go back to sleep
+REPLY_FLAG_MORE = 2 # another data packet follows in this burst
+REPLY_FLAG_DELTA = 4 # base image id and map of the changed blocks
+REPLY_FLAG_RLE = 8 # compressed image, the number of blocks is in the top byte
+REPLY_FLAG_WAKE = 16 # wake on radio, the tag says hello once it stops
+REPLY_FLAG_DRAW = 32 # display list, the number of blocks is in the top byte
+REPLY_FLAG_TEMPLATE = 64 # template, the number of blocks is in the top byte
+REPLY_FLAG_GROUP = 128 # with OK the data is the tag's group ID, with WAKE a broadcast follows
+
+# flags in the OK reply
+OK_FLAG_QUEUED = 1 # there is more for the tag, it says hello again soon
+
+# wake ups have the tag that they are for in the data, or this for
+# all of the tags in the group
+WAKE_ALL = 0xFFFFFFFF
+
+# data packets with this set in the offset are coded blocks, with the
+# seed of the set of blocks that they are the XOR of in the rest of it
+REPLY_OFFSET_CODED = 0x8000
+CODED_DEGREES = [ 1, 2, 2, 3, 3, 4, 4, 6, 6, 8, 8, 12, 16, 24, 32, 64 ]
+
+# the top byte of the hello flags is the link setting that the tag
+# listens with for the reply, see src/radio.h, and a count of its
+# hellos.  the rate and FEC have to match ours, the power is what the
+# tag sends its hellos at.
+LINK_RATE = 0x03 # 500, 250, 125 or 100 Kbps
+LINK_NOFEC = 0x04
+LINK_LOW = 0x08 # about -10 dBm
+LINK_HIGH = 0x10 # about +1 dBm
+LINK_BASE = 0x00
+LINK_KBPS = [ 500, 250, 125, 100 ]
+LINK_SPEEDS = [ 0x00, 0x01, 0x03, 0x04 ] # data rate register, 500 Kbps / (n + 1)
+
+# the settings that tags are stepped through, fastest first, with the
+# RSSI of their hello that moving up to one needs, if the radio has it
+LINKS = [
+    (LINK_NOFEC | LINK_LOW, -70),
+    (LINK_NOFEC, -80),
+    (LINK_BASE, -85),
+    (1, -88),
+    (2 | LINK_HIGH, -91),
+    (3 | LINK_HIGH, None),
+]
+LINK_SAFE = LINKS[-1][0] # what the tags fall back to
+
+BLOCK_SIZE = 32
+ROW_SIZE = 16
+
+# the tags keep this many of the images before the current one
+IMG_LOG = 31
+
+class tag_session:
+    # what the gateway knows about one tag and the transfer to it
+    def __init__(self, client_id, tag_type, githash, now):
+        self.client_id = client_id
+        self.tag_type = tag_type
+        self.githash = githash
+        self.state = 'new'
+        self.img_id = None # image that the tag reports having
+        self.flags = 0 # from its last hello
+        self.group_sent = None # group ID in the last OK
+        self.slot = None # that it checks in at
+        self.slot_at = None # when its next check in is due
+        self.queued_at = None # when it was last told that there is more
+        self.slot_error = None # how far off the last one was, in seconds
+        self.ok_at = None # when the last OK was sent
+        self.ok_seq = 0
+        self.group = None # that it says that it is listening on
+        self.stored = [] # images that it has finished, oldest first
+        self.target_id = None # image that is being sent to it
+        self.total = 0 # blocks in the stream for the target image
+        self.outstanding = [] # offsets that the tag reported missing
+        self.sent = set() # offsets sent since the transfer started
+        self.hellos = 0 # during this transfer
+        self.blocks_sent = 0
+        self.retries = 0 # blocks that were sent but did not arrive
+        self.stalls = 0 # hellos in a row without any progress
+        self.link = link_index(LINK_BASE) # in LINKS, sent in the last OK
+        self.link_sent = 0 # blocks since then
+        self.link_lost = 0
+        self.link_fallback = False # the tag didn't hear us at it
+        self.link_replied = None # count, setting and time of the last hello we answered
+        self.link_clean = 0 # OKs in a row without any losses
+        self.link_hold = 1 # that it takes to try a faster one
+        self.rssi = None # of its last hello
+        self.voltage = 0
+        self.wor = False # listens for wake ups between check ins
+        self.woken_for = None # image that it was last woken up for
+        self.woken_at = 0
+        self.wakes = 0 # for that image
+        self.first_seen = now # on the gateway's clock
+        self.last_seen = self.first_seen
+        self.started = self.first_seen
+
+    def start(self, target_id, total, now):
+        self.target_id = target_id
+        self.total = total
+        self.outstanding = []
+        self.sent = set()
+        self.hellos = 0
+        self.stalls = 0
+        self.started = now
+
+    def store(self, img_id):
+        # it has all of an image, which stays in its log
+        # until enough newer ones have been sent
+        if img_id in self.stored:
+            self.stored.remove(img_id)
+        self.stored = self.stored[-(IMG_LOG - 1):] + [img_id]
+
+    def update(self, missing):
+        # blocks that we sent and the tag still reports were lost
+        lost = len([offset for offset in missing if offset in self.sent])
+        self.retries += lost
+        self.link_lost += lost
+        self.sent -= set(missing)
+
+        if self.outstanding and len(missing) >= len(self.outstanding):
+            self.stalls += 1
+        else:
+            self.stalls = 0
+        self.outstanding = missing
+
+    def progress(self):
+        if self.total == 0:
+            return 1.0
+        return 1.0 - len(self.outstanding) / self.total
+
 class eink_server:
-    def __init__(self, gateway_id=0xaed8e4fd, channel=4):
-        self.radio = a7106.A7106(channel=channel, id=gateway_id, packet_len=40)
+    def __init__(self, gateway_id=0xaed8e4fd, group_id=0xafcd613d, channel=4, sim=False, radio=None):
+        # fleet.py passes in its own radio, and its own time module
+        if radio is not None:
+            self.radio = radio
+        elif sim:
+            import simradio as radio
+            self.radio = radio.SimRadio(channel=channel, id=gateway_id, packet_len=40)
+        else:
+            import a7106 as radio
+            self.radio = radio.A7106(channel=channel, id=gateway_id, packet_len=40)
+
+        # corrupted packets, mostly hellos from tags that talked at
+        # once, which they listen before doing to keep this down
+        self.RxError = radio.RxError
+        self.rx_errors = 0
 
         self.gateway_id = gateway_id
         self.img_id = 0
+
+        # recent images by id, so that tags can be sent deltas,
+        # and their compressed form if that is any shorter.
+        # labels and templates also have what the tags render them from.
+        self.images = {}
+        self.compressed = {}
+        self.labels = {}
+
+        # templates that have been loaded by name, for fill()
+        self.templates = {}
+
+        # the image for each tag, if it is not the default one
+        self.assignments = {}
+        self.sessions = {}
+
+        # time for the tag to store a block before the next one arrives
+        self.burst_gap = 0 if sim else 0.005
+
+        # the tag can only hear us right after its hello, so the bursts
+        # are shared out between the tags that are in the middle of a
+        # transfer; each one says hello again at the end of its burst
+        self.max_burst = 32
+        self.min_burst = 4
+        self.active_time = 30
+
+        # tags that stop making progress are told to go back to sleep
+        # and try again later when others are waiting
+        self.max_stalls = 4
+
+        self.report_interval = 60
+        self.last_report = 0
+
+        # the tags check in at a slot in each period, which the OK
+        # replies give them the time to, instead of on their own and
+        # colliding.  slot_time has room for a hello and a short burst,
+        # so the number of slots is the most tags that one gateway can
+        # have.  the slots of tags that haven't been heard from for
+        # slot_expire go to new ones; tags that aren't finding anything
+        # new skip up to 32 periods.  in the simulator the clock is
+        # the tag's, so that it can be checked against its VLO, and
+        # the sessions are timed by it too.
+        self.clock = self.radio.time if sim else time.time
+        self.slot_period = 768
+        self.slot_time = 0.25
+        self.slot_expire = 40 * self.slot_period
+        self.slots = {} # slot number to client id
+
+        # an OK that says there is more brings the tag's next hello
+        # forward to a few seconds, so it isn't woken up as well
+        # unless that doesn't arrive in queued_hold
+        self.queued_hold = 30
+
+        # tags with wake on radio listen for 4 ms every 2 s, so the
+        # wake packet is repeated for two of those in case one is lost,
+        # and again if the tag has not said hello a while later.
+        # the receive timeout is how often we look for tags to wake.
+        self.wake_time = 4.2
+        self.wake_retry = 30
+        self.max_wakes = 3
+        self.wake_poll = 1.0
+
+        # tags share a group ID, so that when several of them are
+        # waiting for the same image it is sent once to all of them.
+        # they start listening up to a WOR period after the wake ends,
+        # so the blocks go round for a bit longer than that, and then
+        # the ones that missed some say hello like any other time.
+        # with the simulator only the tag's time counts, so it is
+        # a number of passes instead, and it has only one tag.
+        self.group_id = group_id
+        self.groups = {}
+        self.min_broadcast = 1 if sim else 2
+        self.broadcast_time = 0 if sim else 2.5
+        self.broadcast_passes = 2 if sim else 1
+        self.broadcasts = 0
+        self.broadcast_blocks = 0
+
+        # tags that can decode them are sent the blocks once and then
+        # coded blocks, each of which can fill in a different lost
+        # block at each tag, instead of going round again
+        self.coded_repair = 0.5
+        self.coded_seed = 1
+
+        # each tag is moved to a faster link setting after link_hold
+        # clean sessions, and back down when more than one in
+        # link_loss blocks are lost or it falls back on its own.  the
+        # hold doubles each time, so a marginal tag settles.
+        self.link_loss = 8
+        self.link_hold_max = 32
+        self.link_retry = 1.0
+        self.link_fallbacks = 0
+
+        # simulator runs step through a list of images,
+        # moving on each time a tag reports the current one complete,
+        # or every next_every seconds of the tag's time if it is set
+        self.next_images = []
+        self.next_every = None
+        self.next_at = None
         #self.radio.set_id(self.gateway_id)
 
-    def serve(self):
-        clients = {}
+    def missing_blocks(self, stream, img_map):
+        # offsets of the blocks that are not yet marked in the map,
+        # 250 * 128 = 32000 bits / (32 * 8 bits per packet) = 125 packets
+        missing = []
+        for i in range(0, (len(stream) + BLOCK_SIZE - 1) // BLOCK_SIZE):
+            if img_map[i // 8] & (1 << (i % 8)) != 0:
+                missing.append(BLOCK_SIZE * i)
+        return missing
+
+    def add_image(self, image, img_id, lbl=None):
+        # the images that a label uses go in first, so that they
+        # are not the ones that are dropped
+        if lbl is not None:
+            for (dep_id, (dep, dep_lbl)) in lbl.deps.items():
+                self.add_image(dep, dep_id, dep_lbl)
+                if dep_lbl is not None and dep_lbl.template is not None:
+                    self.templates[dep_lbl.name] = (dep_id, dep, dep_lbl)
+
+        self.images.pop(img_id, None)
+        self.images[img_id] = image
+        self.compressed[img_id] = rle_encode(image)
+        self.labels[img_id] = lbl
+        while len(self.images) > 8:
+            del self.compressed[next(iter(self.images))]
+            del self.labels[next(iter(self.images))]
+            del self.images[next(iter(self.images))]
+
+    def set_image(self, image, img_id, lbl=None):
+        self.add_image(image, img_id, lbl)
+
+        self.image = image
+        self.img_id = img_id
+
+    def assign(self, client_id, image, img_id, lbl=None):
+        # send a tag its own image instead of the default one
+        self.add_image(image, img_id, lbl)
+        self.assignments[client_id] = img_id
+
+    def group(self, client_id, group_id):
+        # put a tag in a different group, from its next check in.
+        # the IDs need the same autocorrelation as the tag addresses.
+        self.groups[client_id] = group_id
+
+    def fill(self, name, values):
+        # a label from a template that has been loaded and the text
+        # for its fields, for set_image() or assign().  once a tag has
+        # the template this is all that it is sent.
+        (tpl_id, tpl_img, tpl) = self.templates[name]
+        lbl = label.Label()
+        lbl.dl = label.fill(tpl_id, tpl, values) + bytes([label.DRAW_END])
+        lbl.deps[tpl_id] = (tpl_img, tpl)
+        lbl.uses_template = True
+        return (label.render(lbl.dl, lbl.deps), image_id(lbl.dl), lbl)
+
+    def drawable(self, img_id, hello_flags):
+        # if the tag is sent the display list for a label
+        lbl = self.labels[img_id]
+        if lbl is None or lbl.dl is None or (hello_flags & HELLO_FLAG_DRAW) == 0:
+            return False
+        return not lbl.uses_template or (hello_flags & HELLO_FLAG_TEMPLATE) != 0
+
+    def target(self, session):
+        img_id = self.assignments.get(session.client_id, self.img_id)
+        if img_id not in self.images:
+            img_id = self.img_id
+
+        # the images that a display list draws from go first
+        if self.drawable(img_id, session.flags):
+            for dep_id in self.labels[img_id].deps:
+                if dep_id in self.images and dep_id not in session.stored:
+                    return dep_id
+        return img_id
+
+    def stream(self, img_id, hello_flags):
+        # the bytes that the tag stores for an image,
+        # and the reply flags to tell it how they are encoded
+        lbl = self.labels[img_id]
+        if lbl is not None and lbl.template is not None and (hello_flags & HELLO_FLAG_TEMPLATE):
+            tpl = lbl.template + bytes(-len(lbl.template) % BLOCK_SIZE)
+            return (tpl, REPLY_FLAG_TEMPLATE | (len(tpl) // BLOCK_SIZE) << 8)
+        if self.drawable(img_id, hello_flags):
+            dl = lbl.dl + bytes(-len(lbl.dl) % BLOCK_SIZE)
+            return (dl, REPLY_FLAG_DRAW | (len(dl) // BLOCK_SIZE) << 8)
+        rle = self.compressed[img_id]
+        if (hello_flags & HELLO_FLAG_RLE) and rle is not None:
+            return (rle, REPLY_FLAG_RLE | (len(rle) // BLOCK_SIZE) << 8)
+        return (self.images[img_id], 0)
+
+    def changed_blocks(self, stream, base):
+        # map of the blocks that differ from the base image,
+        # with a 1 for each block that the tag has to receive
+        changed = bytearray(16)
+        for i in range(0, (len(stream) + BLOCK_SIZE - 1) // BLOCK_SIZE):
+            offset = BLOCK_SIZE * i
+            if stream[offset:offset+BLOCK_SIZE] != base[offset:offset+BLOCK_SIZE]:
+                changed[i // 8] |= 1 << (i % 8)
+        return bytes(changed)
+
+    def changed_rows(self, image, base):
+        # first and last row that will look different on the display
+        rows = [y for y in range(0, len(image) // ROW_SIZE)
+          if image[y*ROW_SIZE:(y+1)*ROW_SIZE] != base[y*ROW_SIZE:(y+1)*ROW_SIZE]]
+        if len(rows) == 0:
+            return (0xFF, 0)
+        return (rows[0], rows[-1])
+
+    def send_block(self, img_id, stream, offset, flags):
+        self.radio.transmit(
+          struct.pack("<IHH", img_id, offset, flags) + stream[offset:offset+BLOCK_SIZE])
+
+    def send_ok(self, session, img_id, queued=False):
+        # back to sleep until its slot, with the group to listen on
+        # if it doesn't have it, and the time since the last OK that
+        # it measures its clock against
+        flags = REPLY_FLAG_OK
+        ok_flags = 0
+        session.queued_at = None
+        if queued:
+            ok_flags |= OK_FLAG_QUEUED
+            session.queued_at = self.clock()
+        group_id = self.groups.get(session.client_id, self.group_id)
+        if session.group != group_id:
+            flags |= REPLY_FLAG_GROUP
+            session.group_sent = group_id
+
+        now = self.clock()
+        slot_ms = 0
+        slot = self.assign_slot(session)
+        if slot is not None:
+            # the next one that is far enough away to be worth sleeping for
+            start = slot * self.slot_time
+            periods = math.ceil((now + self.slot_period / 4 - start) / self.slot_period)
+            session.slot_at = start + periods * self.slot_period
+            slot_ms = int((session.slot_at - now) * 1000)
+
+        elapsed_ms = 0
+        if session.ok_at is not None:
+            elapsed_ms = min(int((now - session.ok_at) * 1000), 0xFFFFFFFF)
+        session.ok_at = now
+        session.ok_seq = (session.ok_seq + 1) & 0xFF
+
+        link = self.adapt_link(session)
+        self.radio.transmit(struct.pack("<IHHIIIHBBB", img_id, 0, flags,
+          group_id, slot_ms, elapsed_ms, self.slot_period, session.ok_seq, link, ok_flags))
+
+    def adapt_link(self, session):
+        # the setting for its next session, from how this one went
+        i = session.link
+        if session.link_fallback \
+        or session.link_lost * self.link_loss > max(session.link_sent, 4):
+            i = min(i + 1, len(LINKS) - 1)
+            session.link_hold = min(session.link_hold * 2, self.link_hold_max)
+            session.link_clean = 0
+        elif session.link_lost == 0:
+            session.link_clean += 1
+            if i > 0 and session.link_clean >= session.link_hold \
+            and (session.rssi is None or session.rssi >= LINKS[i-1][1]):
+                i -= 1
+                session.link_clean = 0
+
+        if i != session.link:
+            print(now(), '%08x: link %s rssi %s sent %d lost %d%s' % (
+              session.client_id, link_name(LINKS[i][0]), session.rssi,
+              session.link_sent, session.link_lost,
+              ' fallback' if session.link_fallback else ''))
+
+        session.link = i
+        session.link_sent = 0
+        session.link_lost = 0
+        session.link_fallback = False
+        return LINKS[i][0]
+
+    def assign_slot(self, session):
+        # the tag's check in slot, or None if they are all taken
+        if session.slot is not None:
+            return session.slot
+
+        cutoff = self.clock() - self.slot_expire
+        for (slot, client_id) in list(self.slots.items()):
+            if self.sessions[client_id].last_seen < cutoff:
+                self.sessions[client_id].slot = None
+                del self.slots[slot]
+
+        # start from where the ID falls, so that they are spread out
+        count = int(self.slot_period / self.slot_time)
+        for i in range(count):
+            slot = (session.client_id + i) % count
+            if slot in self.slots:
+                continue
+            self.slots[slot] = session.client_id
+            session.slot = slot
+            print(now(), '%08x: slot %d of %d' % (session.client_id, slot, count))
+            return slot
+
+        return None
+
+    def active_sessions(self):
+        # tags that are part way through a transfer
+        cutoff = self.clock() - self.active_time
+        return [s for s in self.sessions.values()
+          if s.state in ('delta', 'sending') and s.last_seen >= cutoff]
+
+    def burst_size(self):
+        active = max(1, len(self.active_sessions()))
+        return max(self.min_burst, self.max_burst // active)
+
+    def report(self, force=False):
+        # fleet wide progress, every so often or when a tag finishes
+        if not force and self.clock() - self.last_report < self.report_interval:
+            return
+        self.last_report = self.clock()
+
+        sessions = self.sessions.values()
+        complete = len([s for s in sessions if s.state == 'complete'])
+        total = sum(s.total for s in sessions)
+        done = sum(s.total - len(s.outstanding) for s in sessions)
+        errors = [abs(s.slot_error) for s in sessions if s.slot_error is not None]
+        print(now(), 'fleet: %d tags %d complete %d active blocks %d/%d sent %d retries %d errors %d slots %d/%d off %.2f fallbacks %d' % (
+          len(sessions), complete, len(self.active_sessions()), done, total,
+          sum(s.blocks_sent for s in sessions),
+          sum(s.retries for s in sessions), self.rx_errors,
+          len(self.slots), int(self.slot_period / self.slot_time),
+          max(errors) if errors else 0, self.link_fallbacks))
+
+    def hello(self, data):
+        [tag_type,client_id,githash,install_date,voltage,hello_flags,img_id] = struct.unpack('<IIIIHHI',data[0:24])
+        img_map = data[24:]
 
+        session = self.sessions.get(client_id)
+        if session is None:
+            session = tag_session(client_id, tag_type, githash, self.clock())
+            self.sessions[client_id] = session
+            print(now(), "%08x: New client type %08x hash %08x" % (client_id, tag_type, githash))
+
+        # how close to its slot it was, if this is its check in,
+        # which may be some periods later if it has been skipping them
+        if session.slot_at is not None \
+        and self.clock() > session.slot_at - self.slot_period / 8:
+            error = (self.clock() - session.slot_at + self.slot_period / 2) % self.slot_period - self.slot_period / 2
+            if abs(error) < self.slot_period / 8:
+                session.slot_error = error
+
+        # the tag's current image is the newest one in its log
+        session.flags = hello_flags
+        session.group = session.group_sent if (hello_flags & HELLO_FLAG_GROUP) else None
+        if img_id in self.images \
+        and len(self.missing_blocks(self.stream(img_id, hello_flags)[0], img_map)) == 0:
+            session.store(img_id)
+
+        target_id = self.target(session)
+        (stream, stream_flags) = self.stream(target_id, hello_flags)
+        if session.target_id != target_id:
+            session.start(target_id, (len(stream) + BLOCK_SIZE - 1) // BLOCK_SIZE, self.clock())
+
+        session.hellos += 1
+        session.last_seen = self.clock()
+        session.voltage = voltage * 5.0 / 1024
+        session.img_id = img_id
+        session.wor = (hello_flags & HELLO_FLAG_WOR) != 0
+
+        # it has already switched to this to listen for the reply, and
+        # only goes to the slowest one if it didn't hear the last.  that
+        # is the link's fault if we answered the hello just before this
+        # one, otherwise it was the hello that was lost, which is always
+        # at the base setting.  the count is only three bits.
+        link = (hello_flags >> 8) & 0x1F
+        seq = hello_flags >> 13
+        session.rssi = self.radio.rssi()
+        if link == LINK_SAFE and session.link_replied is not None \
+        and session.link_replied[0] == (seq - 1) & 7 \
+        and session.link_replied[1] != LINK_SAFE \
+        and self.clock() - session.link_replied[2] < self.link_retry:
+            session.link_fallback = True
+            self.link_fallbacks += 1
+        session.link_replied = (seq, link, self.clock())
+
+        self.radio.set_id(client_id)
+        self.radio.set_link(LINK_SPEEDS[link & LINK_RATE], (link & LINK_NOFEC) == 0)
+
+        if img_id != target_id and (hello_flags & HELLO_FLAG_DELTA) \
+        and img_id in self.images:
+            (base, _) = self.stream(img_id, hello_flags)
+            changed = self.changed_blocks(stream, base)
+            missing = self.missing_blocks(stream, changed)
+
+            if len(self.missing_blocks(base, img_map)) == 0 \
+            and len(missing) * BLOCK_SIZE < len(stream):
+                # they have all of an older image, so tell them which
+                # blocks to keep and then send only the changed ones
+                (first, last) = self.changed_rows(self.images[target_id], self.images[img_id])
+                self.radio.transmit(
+                  struct.pack("<IHHI", target_id, 0, REPLY_FLAG_DELTA | stream_flags, img_id) + changed + bytes([first, last]))
+                session.state = 'delta'
+                session.update(missing)
+                print(now(), '%08x: %08x delta to %08x blocks %d voltage %.2f' % (client_id, img_id, target_id, len(missing), session.voltage))
+                return
+
+        if img_id != target_id:
+            # they have a different image, send the first block
+            # on its own since the tag erases the old one first
+            missing = [0]
+            session.update(self.missing_blocks(stream, bytes([0xFF] * 16)))
+        else:
+            missing = self.missing_blocks(stream, img_map)
+            session.update(missing)
+
+        if len(missing) == 0:
+            self.send_ok(session, target_id, queued=len(self.next_images) > 0 and self.next_every is None)
+            if session.state != 'complete':
+                session.state = 'complete'
+                print(now(), '%08x: %08x complete in %.1f seconds hellos %d retries %d link %s voltage %.2f' % (
+                  client_id, img_id, self.clock() - session.started, session.hellos, session.retries,
+                  link_name(link), session.voltage))
+                self.report(force=True)
+            if self.next_images and self.next_every is None:
+                self.set_image(*self.next_images.pop(0))
+            return
+
+        if session.stalls >= self.max_stalls and len(self.active_sessions()) > 1:
+            # not getting anywhere, let the others have the radio
+            self.send_ok(session, target_id, queued=True)
+            session.stalls = 0
+            print(now(), '%08x: deferred with %d blocks missing' % (client_id, len(missing)))
+            return
+
+        session.state = 'sending'
+
+        if (hello_flags & HELLO_FLAG_BURST) == 0:
+            # older firmware takes one packet per hello
+            missing = missing[0:1]
+        else:
+            missing = missing[0:self.burst_size()]
+
+        for offset in missing[:-1]:
+            self.send_block(target_id, stream, offset, REPLY_FLAG_MORE | stream_flags)
+            time.sleep(self.burst_gap)
+        self.send_block(target_id, stream, missing[-1], stream_flags)
+
+        session.sent.update(missing)
+        session.blocks_sent += len(missing)
+        session.link_sent += len(missing)
+        print(now(), '%08x: %08x offset %d blocks %d progress %d/%d voltage %.2f' % (
+          client_id, img_id, missing[0], len(missing),
+          session.total - len(session.outstanding), session.total, session.voltage))
+
+    def wake(self):
+        # call back the sleeping tags that have a new image waiting,
+        # instead of leaving it until their next check in.  the ones
+        # in the same group that are waiting for the same stream are
+        # sent it all at once.
+        waiting = {}
+        for session in list(self.sessions.values()):
+            target_id = self.target(session)
+            if not session.wor or session.state != 'complete' \
+            or session.img_id == target_id:
+                continue
+
+            # it is about to say hello anyway
+            if session.queued_at is not None \
+            and self.clock() - session.queued_at < self.queued_hold:
+                continue
+
+            if session.woken_for != target_id:
+                session.woken_for = target_id
+                session.wakes = 0
+            elif session.wakes >= self.max_wakes \
+            or self.clock() - session.woken_at < self.wake_retry:
+                continue
+
+            (stream, stream_flags) = self.stream(target_id, session.flags)
+            coded = (session.flags & HELLO_FLAG_CODED) != 0
+            key = (session.group, target_id, stream_flags, coded)
+            waiting.setdefault(key, []).append(session)
+
+        for ((group_id, target_id, stream_flags, coded), sessions) in waiting.items():
+            if group_id is not None and len(sessions) >= self.min_broadcast:
+                self.broadcast(group_id, target_id, sessions, coded)
+                continue
+
+            for session in sessions:
+                session.woken_at = self.clock()
+                session.wakes += 1
+                self.radio.set_id(session.group or session.client_id)
+                self.radio.wake(struct.pack("<IHHI", target_id, 0, REPLY_FLAG_WAKE, session.client_id), self.wake_time)
+                print(now(), '%08x: woken for %08x' % (session.client_id, target_id))
+
+    def broadcast(self, group_id, target_id, sessions, coded):
+        # wake the whole group and send all of the blocks round until
+        # they have all had time to start listening.  the ones that
+        # already have it or don't hear it say hello on their own.
+        (stream, stream_flags) = self.stream(target_id, sessions[0].flags)
+        for session in sessions:
+            session.woken_at = self.clock()
+            session.wakes += 1
+            session.start(target_id, len(stream) // BLOCK_SIZE, self.clock())
+            session.state = 'broadcast'
+
+        self.radio.set_id(group_id)
+        self.radio.wake(struct.pack("<IHHI", target_id, 0, REPLY_FLAG_WAKE | REPLY_FLAG_GROUP, WAKE_ALL), self.wake_time)
+
+        end = self.clock() + self.broadcast_time
+        blocks = len(stream) // BLOCK_SIZE
+        passes = 0
+        sent = 0
+        while passes < self.broadcast_passes or self.clock() < end:
+            if passes == 0 or not coded:
+                for offset in range(0, len(stream), BLOCK_SIZE):
+                    self.send_block(target_id, stream, offset, REPLY_FLAG_MORE | stream_flags)
+                    time.sleep(self.burst_gap)
+                sent += blocks
+            else:
+                for i in range(max(1, int(blocks * self.coded_repair))):
+                    self.send_coded(target_id, stream, REPLY_FLAG_MORE | stream_flags)
+                    time.sleep(self.burst_gap)
+                    sent += 1
+            passes += 1
+
+        self.broadcasts += 1
+        self.broadcast_blocks += sent
+        print(now(), 'group %08x: %08x to %d tags blocks %d sent %d%s' % (
+          group_id, target_id, len(sessions), blocks, sent, ' coded' if coded else ''))
+
+    def send_coded(self, img_id, stream, flags):
+        seed = self.coded_seed
+        self.coded_seed = self.coded_seed % (REPLY_OFFSET_CODED - 1) + 1
+        self.radio.transmit(
+          struct.pack("<IHH", img_id, REPLY_OFFSET_CODED | seed, flags) + coded_block(stream, seed))
+
+    def next_image(self):
+        # the timed steps through the simulator's list, which the
+        # tags pick up at their next check in or wake up
+        if not self.next_images or self.next_every is None \
+        or self.clock() < self.next_at:
+            return
+        self.set_image(*self.next_images.pop(0))
+        self.next_at += self.next_every
+        print(now(), 'image id %08x' % (self.img_id))
+
+    def serve(self):
         while True:
             try:
+                # hellos and wake ups are always at the base setting
                 self.radio.set_id(self.gateway_id)
-                data = self.radio.blocking_receive()
+                self.radio.set_link(LINK_SPEEDS[0], True)
+                data = self.radio.blocking_receive(timeout=self.wake_poll)
 
 		# received the hello message
                 #print('got packet, data_length={} data={}'.format(len(data), data))
+                if data is not None:
+                    self.next_image()
+                    self.hello(data)
+                    self.radio.set_link(LINK_SPEEDS[0], True)
+                self.wake()
+                self.report()
 
-                [tag_type,client_id,githash,install_date,voltage,reserved,img_id] = struct.unpack('<IIIIHHI',data[0:24])
-                img_map = data[24:]
-                voltage = voltage * 5.0 / 1024
-
-                new = False
-                if not client_id in clients:
-                    clients[client_id] = {
-                        'rx_count': 0,
-                        'img_id': img_id,
-		    }
-                    new = True
-                clients[client_id]['rx_count'] += 1
-
-                offset = None
-                flags = 0
-                if img_id != self.img_id:
-                    # they have a different image
-                    #print(now(), '%08x: old image!' % (client_id))
-                    offset = 0
-                else:
-                    # find the first not present packet in the image
-                    # 250 * 128 = 32000 bits / (32 * 8 bits per packet) = 125 packets
-                    for i in range(0,126):
-                       b = img_map[i // 8]
-                       mask = 1 << (i % 8)
-                       if b & mask != 0:
-                          offset = 32 * i
-                          break
-
-                if offset is None:
-                    #print(now(), '%08x: image %08x complete' % (client_id, img_id))
-                    offset = 0
-                    flags = 1 # go back to sleep
-
-                #print('%08x: sending %d' % (client_id, offset))
-
-                self.radio.set_id(client_id)
-                self.radio.transmit(
-                  struct.pack("<IHH", self.img_id, offset, flags) + self.image[offset:offset+32])
-
-                if new:
-                    print(now(), "%08x: New client type %08x hash %08x" % (client_id, tag_type, githash))
-                if (flags & 1) == 0:
-                    print(now(), '%08x: %08x offset %d voltage %.2f' % (client_id, img_id, offset, voltage))
-                else:
-                    print(now(), '%08x: %08x complete voltage %.2f' % (client_id, img_id, voltage))
-
-            #except a7106.RxError as e:
+            except self.RxError as e:
+                self.rx_errors += 1
+                print(now(), e)
             except Exception as e:
                 print(now(), e)
 
+def link_index(link):
+	for (i, (setting, rssi)) in enumerate(LINKS):
+		if setting == link:
+			return i
+	return None
+
+def link_name(link):
+	return '%dk%s%s' % (LINK_KBPS[link & LINK_RATE],
+	  '' if link & LINK_NOFEC else '+fec',
+	  '-low' if link & LINK_LOW else '+high' if link & LINK_HIGH else '')
+
+def coded_rand(x):
+	x ^= (x << 7) & 0xFFFF
+	x ^= x >> 9
+	x ^= (x << 8) & 0xFFFF
+	return x
+
+def coded_set(seed, blocks):
+	# the blocks that a coded block is the XOR of, the same as
+	# coded_start() and coded_next() in the firmware
+	mask = 0
+	while mask < blocks - 1:
+		mask = (mask << 1) | 1
+	x = coded_rand(seed)
+	n = min(CODED_DEGREES[x & 15], mask + 1)
+	x = coded_rand(x)
+	i = x & mask
+	x = coded_rand(x)
+	step = (x | 1) & mask
+	for j in range(n):
+		if i < blocks:
+			yield i
+		i = (i + step) & mask
+
+def coded_block(stream, seed):
+	block = bytearray(BLOCK_SIZE)
+	for i in coded_set(seed, len(stream) // BLOCK_SIZE):
+		for j in range(BLOCK_SIZE):
+			block[j] ^= stream[i * BLOCK_SIZE + j]
+	return bytes(block)
+
+def rle_encode(image):
+	# XOR each row with the one above it, so that white space and the
+	# vertical edges of text turn into runs of zeros, then store the
+	# lengths of the alternating runs of 0 and 1 bits, starting with 0.
+	# Runs shorter than 15 are one nibble, longer ones are a 15 followed
+	# by bytes that are added on until one is less than 255.
+	# This is decoded by img_draw_rle() in the firmware.
+	rows = bytearray(image)
+	for i in range(len(rows) - 1, ROW_SIZE - 1, -1):
+		rows[i] ^= rows[i - ROW_SIZE]
+
+	nibbles = []
+	bit = 0
+	run = 0
+	for byte in rows:
+		for i in range(7, -1, -1):
+			if (byte >> i) & 1 == bit:
+				run += 1
+				continue
+			rle_run(nibbles, run)
+			bit ^= 1
+			run = 1
+	rle_run(nibbles, run)
+
+	if len(nibbles) % 2 != 0:
+		nibbles.append(0)
+	rle = bytes([nibbles[i] << 4 | nibbles[i+1] for i in range(0, len(nibbles), 2)])
+
+	# padded to whole blocks, and only if it is any shorter
+	rle += bytes(-len(rle) % BLOCK_SIZE)
+	if len(rle) >= len(image):
+		return None
+	return rle
+
+def rle_run(nibbles, run):
+	if run < 15:
+		nibbles.append(run)
+		return
+	nibbles.append(15)
+	run -= 15
+	while True:
+		ext = min(run, 255)
+		nibbles.extend([ext >> 4, ext & 0xF])
+		run -= ext
+		if ext != 255:
+			break
+
+def image_id(data):
+	return int(hashlib.sha256(data).digest()[0:4].hex(), 16)
+
+def load_image(filename):
+	# returns the bitmap, the id and the label.Label for the
+	# display lists and templates
+	if filename.endswith('.label'):
+		lbl = label.parse(filename, load_image)
+		return (label.render(lbl.dl, lbl.deps), image_id(lbl.dl), lbl)
+
+	if filename.endswith('.template'):
+		(img, lbl) = label.parse_template(filename, load_image, rle_encode)
+		lbl.name = os.path.splitext(os.path.basename(filename))[0]
+		return (img, image_id(lbl.template), lbl)
+
+	img = Image.open(filename)
+
+	# rotate it clockwise if the wrong orientation
+	if img.width > img.height:
+		img = img.rotate(-90, expand=True)
+
+	# shrink it to fit
+	if img.width != 128 or img.height != 250:
+		img = img.resize((128,250))
+
+	# convert it to 1 channel
+	if img.mode != "1":
+		img = img.convert(mode="1") #, dither=Image.Dither.FLOYDSTEINBERG)
+
+	# convert it to raw bytes
+	img = ImageOps.flip(img).tobytes()
+	return (img, image_id(img), None)
+
 def monitor_files(server, filename):
 	last_mtime = 0
 	while True:
@@ -90,35 +866,35 @@ def monitor_files(server, filename):
 				continue
 			last_mtime = st.st_mtime
 
-			img = Image.open(filename)
-
-			# rotate it clockwise if the wrong orientation
-			if img.width > img.height:
-				img = img.rotate(-90, expand=True)
-
-			# shrink it to fit
-			if img.width != 128 or img.height != 250:
-				img = img.resize((128,250))
-
-			# convert it to 1 channel
-			if img.mode != "1":
-				img = img.convert(mode="1") #, dither=Image.Dither.FLOYDSTEINBERG)
-
-			# convert it to raw bytes
-			img = ImageOps.flip(img).tobytes()
-			img_id = int(hashlib.sha256(img).digest()[0:4].hex(), 16)
+			(img, img_id, lbl) = load_image(filename)
 			if server.img_id == img_id:
 				time.sleep(1)
 				continue
-			server.image = img
-			server.img_id = img_id
+			server.set_image(img, img_id, lbl)
 			print(now(), 'image id %08x' %(server.img_id))
 		except Exception as e:
 			print(now(), e)
 			time.sleep(5)
 
-server = eink_server()
-fs_thread = Thread(target=monitor_files, args=(server,"hello.png"))
+if __name__ == "__main__":
+	import argparse
+
+	parser = argparse.ArgumentParser(description='E-ink tag gateway')
+	parser.add_argument('--sim', action='store_true', help='Serve the host simulator in src/ over stdin/stdout')
+	parser.add_argument('--every', type=float, help='With --sim, move on to the next image after this many seconds instead of when the tag has the last one')
+	parser.add_argument('image', nargs='*', default=['hello.png'], help='Image or .label display list to send to the tags, or a sequence of them with --sim')
+	args = parser.parse_args()
+
+	server = eink_server(sim=args.sim)
+	if args.every:
+		server.next_every = server.next_at = args.every
+
+	if args.sim:
+		# load the images before the first hello so that runs repeat
+		server.next_images = [load_image(filename) for filename in args.image]
+		server.set_image(*server.next_images.pop(0))
+	else:
+		fs_thread = Thread(target=monitor_files, args=(server,args.image[0]))
+		fs_thread.start()
 
-fs_thread.start()
-server.serve()
+	server.serve()
@@ -0,0 +1,102 @@
+#!/usr/bin/python3
+# Stand-in for the A7106 that talks to the host simulator in src/sim
+# over stdin and stdout instead of the GPIO pins.
+#
+# Each packet is framed as a little endian 32-bit id, a length byte
+# and the data.  An empty frame with id 0 tells the simulator that we
+# are listening again, so that both sides run in lock step.  A frame
+# with id 0 and a 16-bit duration in milliseconds says that the next
+# one is repeated for that long, for waking up tags.  From the
+# simulator a frame with id 0 and five bytes is the tag's clock in
+# milliseconds, which time() returns instead of the real time, and the
+# RSSI in dBm of the packet that follows.  A frame with id 0 and three
+# bytes is our data rate, code and TX power registers, which packets
+# are only heard with if the tag's rate and FEC match.
+import os
+import struct
+import sys
+
+class RxError(Exception):
+    # the simulator drops corrupted packets instead
+    pass
+
+class SimRadio:
+    def __init__(self, id=0, channel=0, packet_len=64):
+        # keep the real stdout for the packets and send
+        # everything that is printed to stderr instead
+        self.tx = os.fdopen(os.dup(1), 'wb')
+        os.dup2(2, 1)
+        self.rx = sys.stdin.buffer
+
+        self.id = id
+        self.packet_length = packet_len
+        self.now = 0
+        self.last_rssi = None
+        self.link = (0x00, True)
+
+    def time(self):
+        return self.now
+
+    def set_id(self, id):
+        self.id = id
+
+    def set_link(self, speed, fec):
+        """ Data rate register and FEC, the power stays at the A7106's """
+        if self.link == (speed, fec):
+            return
+        self.link = (speed, fec)
+        self.send_frame(0, bytes([speed, 0x1F if fec else 0x0F, 0x37]))
+
+    def rssi(self):
+        """ Of the last packet received, in dBm """
+        return self.last_rssi
+
+    def send_frame(self, id, data):
+        self.tx.write(struct.pack('<IB', id, len(data)) + data)
+        self.tx.flush()
+
+    def transmit(self, data):
+        """ Transmit a data packet """
+        if len(data) > self.packet_length:
+            raise Exception('packet data too long, length:{} maximum:{}'.format(len(data),self.packet_length))
+
+        payload = bytearray()
+        payload.extend(data)
+        payload.extend(bytes(self.packet_length-len(payload)))
+        self.send_frame(self.id, bytes(payload))
+
+    def wake(self, data, duration):
+        """ Repeat a packet for duration seconds """
+        self.send_frame(0, struct.pack('<H', int(duration * 1000)))
+        self.transmit(data)
+
+    def read_frame(self):
+        hdr = self.rx.read(5)
+        if len(hdr) != 5:
+            # the simulator has exited
+            sys.exit(0)
+
+        (id,length) = struct.unpack('<IB', hdr)
+        return (id, self.rx.read(length))
+
+    def blocking_receive(self, timeout=None):
+        """ Wait for one packet to be received """
+        # the simulator only moves on when the tag sends something,
+        # so there is no timeout and no None for one
+        while True:
+            self.send_frame(0, b'')
+
+            (id, data) = self.read_frame()
+            if id == 0 and len(data) == 5:
+                # it wraps after 49 days
+                (ms, self.last_rssi) = struct.unpack('<Ib', data)
+                self.now += ((ms - int(self.now * 1000)) & 0xFFFFFFFF) / 1000.0
+                (id, data) = self.read_frame()
+
+            # the real radio only receives packets that match its id
+            if id == self.id:
+                break
+
+        payload = bytearray(data[0:self.packet_length])
+        payload.extend(bytes(self.packet_length-len(payload)))
+        return bytes(payload)
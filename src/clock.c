@@ -0,0 +1,48 @@
+/*
+ * DCO speed policy, see clock.h.
+ *
+ * The calibration constants are in information segment A.  If it has
+ * been erased they read as 0xFF, and the DCO is left where it is.
+ */
+#include <msp430.h>
+#include <stdint.h>
+#include "clock.h"
+
+static uint8_t clock_is_fast;
+
+void clock_fast(void)
+{
+	if (clock_is_fast || CALBC1_8MHZ == 0xFF)
+		return;
+
+	// lowest step first, so the DCO never runs too fast for the range
+	DCOCTL = 0;
+	BCSCTL1 = CALBC1_8MHZ;
+	DCOCTL = CALDCO_8MHZ;
+	clock_is_fast = 1;
+}
+
+void clock_slow(void)
+{
+	if (CALBC1_1MHZ == 0xFF)
+		return;
+
+	DCOCTL = 0;
+	BCSCTL1 = CALBC1_1MHZ;
+	DCOCTL = CALDCO_1MHZ;
+	clock_is_fast = 0;
+}
+
+uint8_t clock_sleep(void)
+{
+	const uint8_t fast = clock_is_fast;
+	if (fast)
+		clock_slow();
+	return fast;
+}
+
+void clock_wake(const uint8_t fast)
+{
+	if (fast)
+		clock_fast();
+}
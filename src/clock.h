@@ -0,0 +1,24 @@
+#ifndef _epd_clock_h_
+#define _epd_clock_h_
+
+#include <stdint.h>
+
+/*
+ * MCLK and SMCLK both come from the DCO, which runs at the factory
+ * calibrated 8 MHz while the MCU is moving bytes between the radio,
+ * the flash and the display, and at 1 MHz otherwise.  16 MHz needs
+ * 3.3V, more than the coin cell has, but 8 MHz works down to 2.2V.
+ * The timer sleeps drop back to 1 MHz while they sleep, so the SMCLK
+ * delays are always counted at 1 MHz.
+ */
+#define CLOCK_SLOW_HZ 1000000
+#define CLOCK_FAST_HZ 8000000
+
+void clock_fast(void);
+void clock_slow(void);
+
+// drop to 1 MHz for a sleep, returns what to restore afterwards
+uint8_t clock_sleep(void);
+void clock_wake(uint8_t fast);
+
+#endif
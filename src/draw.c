@@ -0,0 +1,448 @@
+/*
+ * Display list renderer.
+ *
+ * There isn't enough RAM for a framebuffer, so the list is rendered
+ * one row at a time into a 16 byte row buffer that goes straight to
+ * the display RAM write.  The list stays in the flash and is read
+ * again for each row; it is usually only a few dozen bytes.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "draw.h"
+#include "epd.h"
+#include "flash.h"
+
+#define DRAW_STRIDE	((EPD_WIDTH + 7) / 8)
+#define DRAW_WIDTH	(DRAW_STRIDE * 8)
+
+// the columns are 8 bits with the LSB at the top, the first one blank
+#define FONT_WIDTH	6
+#define FONT_HEIGHT	8
+
+extern const uint8_t font[][FONT_WIDTH];
+
+typedef struct {
+	uint32_t addr;
+	uint16_t left;
+} draw_reader_t;
+
+// the last image looked up for a blit, since it is used on every row,
+// and where its decoder is if it is compressed
+typedef struct {
+	uint32_t id;
+	uint32_t addr;
+	uint8_t rle;
+	draw_rle_t dec;
+} draw_src_t;
+
+// the row and both sources take most of 100 bytes, which is too much
+// stack on a 512 byte part, so they go in the flash staging buffer,
+// which isn't used while drawing
+typedef struct {
+	uint8_t row[DRAW_STRIDE];
+	draw_src_t src[2];
+} draw_state_t;
+
+// doesn't compile if the staging buffer is too small for it
+typedef char draw_state_fits[sizeof(draw_state_t) <= FLASH_STAGE_SIZE ? 1 : -1];
+
+static uint8_t draw_byte(draw_reader_t * const r)
+{
+	if (r->left == 0)
+		return DRAW_END;
+
+	r->left--;
+	r->addr++;
+	return flash_stream_read();
+}
+
+// set the pixels x0 to x1, inclusive, clipped to the row
+static void draw_span(uint8_t * const row, int16_t x0, int16_t x1, const uint8_t color)
+{
+	if (x0 < 0)
+		x0 = 0;
+	if (x1 > DRAW_WIDTH - 1)
+		x1 = DRAW_WIDTH - 1;
+	if (x0 > x1)
+		return;
+
+	const uint8_t i0 = x0 >> 3;
+	const uint8_t i1 = x1 >> 3;
+
+	for(uint8_t i = i0 ; i <= i1 ; i++)
+	{
+		uint8_t mask = 0xFF;
+		if (i == i0)
+			mask &= 0xFF >> (x0 & 7);
+		if (i == i1)
+			mask &= 0xFF << (7 - (x1 & 7));
+
+		if (color == DRAW_BLACK)
+			row[i] &= ~mask;
+		else
+		if (color == DRAW_WHITE)
+			row[i] |= mask;
+		else
+			row[i] ^= mask;
+	}
+}
+
+static void draw_rect(draw_reader_t * const r, uint8_t * const row, const int16_t y)
+{
+	const uint8_t x0 = draw_byte(r);
+	const uint8_t y0 = draw_byte(r);
+	const uint8_t w = draw_byte(r);
+	const uint8_t h = draw_byte(r);
+	const uint8_t color = draw_byte(r);
+
+	if (y < y0 || y >= y0 + h || w == 0)
+		return;
+
+	draw_span(row, x0, x0 + w - 1, color);
+}
+
+// the x at a row, rounded towards the start of the line
+static int16_t draw_line_x(int16_t x0, int16_t y0, int16_t x1, int16_t y1, int16_t y)
+{
+	return x0 + (int16_t)((int32_t)(x1 - x0) * (y - y0) / (y1 - y0));
+}
+
+// each row covers the x from that row up to the next one,
+// so that shallow lines don't have gaps
+static void draw_line(draw_reader_t * const r, uint8_t * const row, const int16_t y)
+{
+	int16_t x0 = draw_byte(r);
+	int16_t y0 = draw_byte(r);
+	int16_t x1 = draw_byte(r);
+	int16_t y1 = draw_byte(r);
+	const uint8_t color = draw_byte(r);
+
+	if (y0 > y1)
+	{
+		int16_t t;
+		t = x0; x0 = x1; x1 = t;
+		t = y0; y0 = y1; y1 = t;
+	}
+
+	if (y < y0 || y > y1)
+		return;
+
+	if (y0 == y1)
+	{
+		if (x0 < x1)
+			draw_span(row, x0, x1, color);
+		else
+			draw_span(row, x1, x0, color);
+		return;
+	}
+
+	int16_t xa = draw_line_x(x0, y0, x1, y1, y);
+	int16_t xb = y == y1 ? xa : draw_line_x(x0, y0, x1, y1, y + 1);
+
+	// the next row starts the step after this one ends
+	if (xb > xa)
+		xb--;
+	else
+	if (xb < xa)
+		xb++;
+
+	if (xa < xb)
+		draw_span(row, xa, xb, color);
+	else
+		draw_span(row, xb, xa, color);
+}
+
+// the characters are read from the list even if this row is blank
+static void draw_chars(draw_reader_t * const r, uint8_t * const row, const int16_t y,
+	const int16_t x, const int16_t y0, const uint8_t scale, const uint8_t color, const uint8_t len)
+{
+	const int16_t bit = scale ? (y - y0) / scale : FONT_HEIGHT;
+	const uint8_t hit = y >= y0 && bit < FONT_HEIGHT;
+
+	for(uint8_t i = 0 ; i < len ; i++)
+	{
+		uint8_t c = draw_byte(r);
+		if (!hit)
+			continue;
+
+		if (c < 0x20 || c > 0x7E)
+			c = '?';
+
+		const uint8_t * const glyph = font[c - 0x20];
+		for(uint8_t col = 0 ; col < FONT_WIDTH ; col++)
+		{
+			if (!(glyph[col] & (1 << bit)))
+				continue;
+
+			const int16_t px = x + (i * FONT_WIDTH + col) * scale;
+			draw_span(row, px, px + scale - 1, color);
+		}
+	}
+}
+
+static void draw_text(draw_reader_t * const r, uint8_t * const row, const int16_t y)
+{
+	const int16_t x = draw_byte(r);
+	const int16_t y0 = draw_byte(r);
+	const uint8_t scale = draw_byte(r);
+	const uint8_t color = draw_byte(r);
+	const uint8_t len = draw_byte(r);
+
+	draw_chars(r, row, y, x, y0, scale, color, len);
+}
+
+static uint32_t draw_id(draw_reader_t * const r)
+{
+	uint32_t id = draw_byte(r);
+	id |= (uint32_t) draw_byte(r) << 8;
+	id |= (uint32_t) draw_byte(r) << 16;
+	id |= (uint32_t) draw_byte(r) << 24;
+	return id;
+}
+
+/*
+ * Copy w bytes from sx in a stored row of an image.  A row of a raw
+ * one is a single flash read, a compressed one is decoded up to that
+ * row, which is usually the next one since the rows are drawn in the
+ * order that they are stored.  The flash only does one thing at a
+ * time, so the list read has to be stopped around this.
+ */
+static void draw_src_row(draw_src_t * const src, const uint32_t id,
+	const uint8_t src_row, const uint8_t sx, const uint8_t w, uint8_t * const out)
+{
+	if (id != src->id)
+	{
+		src->id = id;
+		src->addr = img_bitmap(id, &src->rle);
+		draw_rle_start(&src->dec, src->addr);
+	}
+
+	if (src->addr == DRAW_NONE)
+		return;
+
+	if (!src->rle)
+	{
+		flash_read(src->addr + src_row * DRAW_STRIDE + sx, out, w);
+		return;
+	}
+
+	// start again if an earlier row is wanted
+	if (src->dec.y > src_row + 1)
+		draw_rle_start(&src->dec, src->addr);
+
+	if (src->dec.y <= src_row)
+	{
+		flash_stream_start(src->dec.addr);
+		while (src->dec.y <= src_row)
+			draw_rle_row(&src->dec);
+		flash_stream_stop();
+	}
+
+	memcpy(out, &src->dec.row[sx], w);
+}
+
+// blits are byte aligned
+static void draw_blit(draw_reader_t * const r, uint8_t * const row, const int16_t y, draw_src_t * const src)
+{
+	const uint32_t id = draw_id(r);
+	const uint8_t sx = draw_byte(r);
+	const uint8_t sy = draw_byte(r);
+	uint8_t w = draw_byte(r);
+	const uint8_t h = draw_byte(r);
+	const uint8_t dx = draw_byte(r);
+	const uint8_t dy = draw_byte(r);
+
+	if (y < dy || y >= dy + h)
+		return;
+
+	const int16_t src_y = sy + y - dy;
+	if (src_y >= EPD_HEIGHT || sx >= DRAW_STRIDE || dx >= DRAW_STRIDE)
+		return;
+
+	if (w > DRAW_STRIDE - sx)
+		w = DRAW_STRIDE - sx;
+	if (w > DRAW_STRIDE - dx)
+		w = DRAW_STRIDE - dx;
+
+	// the bitmaps are stored bottom row first
+	flash_stream_stop();
+	draw_src_row(src, id, EPD_HEIGHT - 1 - src_y, sx, w, &row[dx]);
+	flash_stream_start(r->addr);
+}
+
+// the whole row of the template, which has its own decoder so that
+// blits from other images don't restart it
+static void draw_template(draw_reader_t * const r, uint8_t * const row, const int16_t y, draw_src_t * const tpl)
+{
+	const uint32_t id = draw_id(r);
+
+	flash_stream_stop();
+	draw_src_row(tpl, id, EPD_HEIGHT - 1 - y, 0, DRAW_STRIDE, row);
+	flash_stream_start(r->addr);
+}
+
+// the position of the text comes from the field table in the flash,
+// just before the bitmap of the template
+static void draw_field(draw_reader_t * const r, uint8_t * const row, const int16_t y, const draw_src_t * const tpl)
+{
+	const uint8_t n = draw_byte(r);
+	const uint8_t len = draw_byte(r);
+
+	draw_field_t f;
+	memset(&f, 0, sizeof(f));
+
+	if (tpl->addr != DRAW_NONE && n < DRAW_FIELDS)
+	{
+		flash_stream_stop();
+		flash_read(tpl->addr - sizeof(draw_template_t) + offsetof(draw_template_t, field) + n * sizeof(f), &f, sizeof(f));
+		flash_stream_start(r->addr);
+	}
+
+	int16_t x = f.x;
+	const int16_t space = f.w - len * FONT_WIDTH * f.scale;
+	if (f.align == DRAW_ALIGN_RIGHT)
+		x += space;
+	else
+	if (f.align == DRAW_ALIGN_CENTER)
+		x += space / 2;
+
+	draw_chars(r, row, y, x, f.y, f.scale, f.color, len);
+}
+
+static void draw_row(uint8_t * const row, const uint32_t addr, const uint16_t len, const int16_t y, draw_src_t * const src)
+{
+	draw_reader_t r = { addr, len };
+
+	memset(row, 0xFF, DRAW_STRIDE);
+	flash_stream_start(addr);
+
+	while (1)
+	{
+		const uint8_t cmd = draw_byte(&r);
+		if (cmd == DRAW_RECT)
+			draw_rect(&r, row, y);
+		else
+		if (cmd == DRAW_LINE)
+			draw_line(&r, row, y);
+		else
+		if (cmd == DRAW_TEXT)
+			draw_text(&r, row, y);
+		else
+		if (cmd == DRAW_BLIT)
+			draw_blit(&r, row, y, &src[0]);
+		else
+		if (cmd == DRAW_TEMPLATE)
+			draw_template(&r, row, y, &src[1]);
+		else
+		if (cmd == DRAW_FIELD)
+			draw_field(&r, row, y, &src[1]);
+		else
+			break;
+	}
+
+	flash_stream_stop();
+}
+
+void draw_list(const uint32_t addr, const uint16_t len, const uint8_t first, const uint8_t last)
+{
+	draw_state_t * const s = flash_stage_borrow();
+	uint8_t * const row = s->row;
+
+	// one for blits and one for the template, nothing looked up yet
+	draw_src_t * const src = s->src;
+	src[0].id = src[1].id = DRAW_NONE;
+	src[0].addr = src[1].addr = DRAW_NONE;
+
+	epd_data_start();
+
+	// the image rows are bottom first, the list is top first
+	for(uint16_t i = first ; i <= last ; i++)
+	{
+		draw_row(row, addr, len, EPD_HEIGHT - 1 - i, src);
+
+		for(uint8_t x = 0 ; x < DRAW_STRIDE ; x++)
+			epd_data_stream(row[x]);
+	}
+
+	epd_data_end();
+}
+
+/*
+ * Compressed images store each row XOR'ed with the one above it, so
+ * that white space and the vertical edges of text are runs of zeros.
+ * The runs alternate between 0 and 1 bits, starting with 0.  A run
+ * shorter than 15 is a single nibble, high nibble first, otherwise
+ * it is a 15 followed by byte sized extensions until one is not 255.
+ *
+ * The stream is decoded straight out of the flash, so only the
+ * previous row is needed in RAM.
+ */
+void draw_rle_start(draw_rle_t * const r, const uint32_t addr)
+{
+	r->addr = addr;
+	r->nibble = 0;
+	r->y = 0;
+	memset(r->row, 0, sizeof(r->row));
+
+	// the first run is read by the first row, and it is the 0 bits
+	r->run = 0;
+	r->bit = 1;
+}
+
+static uint8_t draw_rle_nibble(draw_rle_t * const r)
+{
+	if (r->nibble++ & 1)
+		return r->byte & 0xF;
+
+	r->addr++;
+	r->byte = flash_stream_read();
+	return r->byte >> 4;
+}
+
+static uint16_t draw_rle_run(draw_rle_t * const r)
+{
+	uint16_t len = draw_rle_nibble(r);
+	if (len != 15)
+		return len;
+
+	// a corrupt or erased stream stops at the size of the image
+	uint8_t ext;
+	do {
+		ext = draw_rle_nibble(r) << 4;
+		ext |= draw_rle_nibble(r);
+		len += ext;
+	} while (ext == 0xFF && len < EPD_HEIGHT * DRAW_WIDTH);
+
+	return len;
+}
+
+void draw_rle_row(draw_rle_t * const r)
+{
+	for(uint8_t x = 0 ; x < DRAW_STRIDE ; x++)
+	{
+		uint8_t byte = 0;
+
+		if (r->run >= 8)
+		{
+			// whole byte from the current run
+			byte = r->bit ? 0xFF : 0x00;
+			r->run -= 8;
+		} else
+		for(uint8_t i = 0 ; i < 8 ; i++)
+		{
+			while (r->run == 0)
+			{
+				r->run = draw_rle_run(r);
+				r->bit ^= 1;
+			}
+
+			byte = (byte << 1) | r->bit;
+			r->run--;
+		}
+
+		r->row[x] ^= byte;
+	}
+
+	r->y++;
+}
@@ -0,0 +1,83 @@
+#ifndef _epd_draw_h_
+#define _epd_draw_h_
+
+/*
+ * Display lists are a few bytes of drawing commands that the tag
+ * renders itself, instead of a bitmap of the whole label.
+ *
+ * Coordinates are pixels with 0,0 at the top left of the label as it
+ * is seen, the same as the images that the server loads.  Rows are
+ * 128 pixels wide, of which the panel shows the first 122.  The list
+ * ends at a DRAW_END or at the end of the stored blocks.
+ */
+#include <stdint.h>
+#include "epd.h"
+
+#define DRAW_END	0x00 // end of the list
+#define DRAW_RECT	0x01 // x, y, w, h, color: filled rectangle
+#define DRAW_LINE	0x02 // x0, y0, x1, y1, color: one pixel wide line
+#define DRAW_TEXT	0x03 // x, y, scale, color, len, chars[len]: 5x7 font
+#define DRAW_BLIT	0x04 // img_id[4], sx/8, sy, w/8, h, x/8, y: copy from an image
+#define DRAW_TEMPLATE	0x05 // img_id[4]: the bitmap of a template, under what follows
+#define DRAW_FIELD	0x06 // n, len, chars[len]: text in field n of the template
+
+#define DRAW_BLACK	0
+#define DRAW_WHITE	1
+#define DRAW_INVERT	2
+
+#define DRAW_ALIGN_LEFT	0
+#define DRAW_ALIGN_RIGHT	1
+#define DRAW_ALIGN_CENTER	2
+
+/*
+ * Templates are a layout that is stored once and then filled in by
+ * short lists of field values.  The first block of one is the field
+ * table, followed by the compressed bitmap.
+ */
+#define DRAW_FIELDS	5
+
+typedef struct {
+	uint8_t x;
+	uint8_t y;
+	uint8_t w; // the text is aligned within this
+	uint8_t scale;
+	uint8_t color;
+	uint8_t align;
+} draw_field_t;
+
+typedef struct {
+	uint8_t fields;
+	uint8_t resv;
+	draw_field_t field[DRAW_FIELDS];
+} draw_template_t;
+
+// returned by img_bitmap() when the image isn't in the flash
+#define DRAW_NONE	0xFFFFFFFF
+
+// render the list at addr into the rows first to last of the display RAM
+void draw_list(uint32_t addr, uint16_t len, uint8_t first, uint8_t last);
+
+// provided by main.c: the flash address of the bitmap of a complete
+// image and if it is compressed, or DRAW_NONE.  for templates it is
+// the bitmap after the field table.
+uint32_t img_bitmap(uint32_t id, uint8_t * rle);
+
+/*
+ * Compressed images are decoded a row at a time, bottom row first.
+ * The flash stream has to be started at addr before each call to
+ * draw_rle_row(), which leaves the row in row[].
+ */
+typedef struct {
+	uint32_t addr; // the next byte of the stream
+	uint16_t run;
+	uint8_t byte;
+	uint8_t nibble;
+	uint8_t bit;
+	uint8_t y; // rows decoded so far
+	uint8_t row[(EPD_WIDTH + 7) / 8];
+} draw_rle_t;
+
+void draw_rle_start(draw_rle_t * r, uint32_t addr);
+void draw_rle_row(draw_rle_t * r);
+
+#endif
@@ -9,6 +9,7 @@
 #include <stdint.h>
 #include "epd.h"
 #include "pins.h"
+#include "timer.h"
 
 #define EPD_POWER	0x31 // I think this is !power, but not sure
 #define EPD_CS		0x34
@@ -21,17 +22,37 @@
 #define EPD_CLK		0x23
 #define EPD_DATA	0x24
 
-static void delay(unsigned count)
+/*
+ * BUSY on P2.5 falls when the controller is done, which raises a
+ * port 2 interrupt, so the MCU sleeps through the refresh instead of
+ * polling it.  If it never falls the timeout gives up, rather than
+ * hanging the tag on a broken panel.
+ */
+#define EPD_BUSY_TIMEOUT 5000
+
+static volatile uint8_t epd_ready;
+
+void __attribute__((interrupt(PORT2_VECTOR)))
+epd_busy_interrupt(void)
 {
-	for(volatile unsigned i = 0 ; i < count ; i++)
-		for(volatile unsigned j = 0 ; j < 1000 ; j++)
-			;
+	P2IFG &= ~BIT5;
+	P2IE &= ~BIT5;
+	epd_ready = 1;
+	LPM3_EXIT;
 }
 
 static void epd_wait_busy(void)
 {
-	while(pin_read(EPD_BUSY) != 0)
-		;
+	epd_ready = 0;
+	P2IES |= BIT5;
+	P2IFG &= ~BIT5;
+	P2IE |= BIT5;
+
+	// if it already fell there won't be an edge
+	if (pin_read(EPD_BUSY) != 0)
+		timer_wait(&epd_ready, EPD_BUSY_TIMEOUT);
+
+	P2IE &= ~BIT5;
 }
 
 static void epd_write(const uint8_t value)
@@ -53,6 +74,27 @@ void epd_data(const uint8_t data)
 	epd_write(data);
 }
 
+/*
+ * The controller takes any number of data bytes in one chip select,
+ * so a frame can be streamed without toggling DC and CS every byte.
+ * Only epd_data_stream() can be called until epd_data_end().
+ */
+void epd_data_start(void)
+{
+	pin_write(EPD_DC, 1);
+	pin_write(EPD_CS, 0);
+}
+
+void epd_data_stream(const uint8_t data)
+{
+	spi_write(EPD_CLK, EPD_DATA, 0, data);
+}
+
+void epd_data_end(void)
+{
+	pin_write(EPD_CS, 1);
+}
+
 void epd_setup(void)
 {
 	// P3 1, 4, 5, 7 are output
@@ -79,9 +121,9 @@ void epd_reset(void)
 {
 	pin_write(EPD_POWER, 0); // switch on transistor
 	pin_write(EPD_RESET, 0);
-	delay(0x32);
+	timer_sleep_ms(10);
 	pin_write(EPD_RESET, 1);
-	delay(0x32);
+	timer_sleep_ms(10);
 
 	// sw reset then wait for busy to go low
 	epd_command(0x12);
@@ -146,7 +188,7 @@ static const unsigned char epd_lut_fast[]= { //20 bytes
 
 
 
-void epd_init(void)
+static void epd_init_lut(const uint8_t * const lut, const unsigned len)
 {
 	// driver output control
 	epd_command(0x01);
@@ -185,8 +227,8 @@ void epd_init(void)
 
 	// lut
 	epd_command(0x32);
-	for(unsigned i = 0 ; i < sizeof(epd_lut_full) ; i++)
-		epd_data(epd_lut_full[i]);
+	for(unsigned i = 0 ; i < len ; i++)
+		epd_data(lut[i]);
 
 	epd_wait_busy();
 
@@ -202,6 +244,22 @@ void epd_init(void)
 	epd_data(0x83);
 }
 
+void epd_init(void)
+{
+	epd_init_lut(epd_lut_full, sizeof(epd_lut_full));
+}
+
+/*
+ * The fast waveform only drives the pixels that change, so it
+ * relies on the controller still holding the previous image.
+ * It leaves some ghosting behind, so a full refresh is needed
+ * every so often.
+ */
+void epd_init_partial(void)
+{
+	epd_init_lut(epd_lut_fast, sizeof(epd_lut_fast));
+}
+
 void epd_set_frame(uint16_t x, uint16_t y, uint16_t w, uint16_t h)
 {
 	// x and w must be multiples of 8
@@ -251,18 +309,19 @@ void epd_display(void)
 	epd_command(0x20);
 
 	epd_wait_busy();
+}
+
 
-	// switch to the other lut
 /*
-	static uint8_t switched_lut = 0;
-	if (switched_lut)
-		return;
-	switched_lut = 1;
+ * Deep sleep mode 1 retains the RAM, so as long as the power stays
+ * on the next update can be a partial one.
+ */
+void epd_sleep(void)
+{
+	epd_command(0x10);
+	epd_data(0x01);
 
-	epd_command(0x32);
-	for(unsigned i = 0 ; i < sizeof(epd_lut_fast) ; i++)
-		epd_data(epd_lut_fast[i]);
-*/
+	pin_write(EPD_CS, 1);
 }
 
 
@@ -1,54 +1,50 @@
 /*
  * SPI flash driver for the MSP430 eink tag.
  *
- * TODO: use the flash controller hardware to do DMA and stuff.
+ * The flash is on the USCI_B0 pins, see spi.h.
  */
 #include <msp430.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include "flash.h"
-#include "pins.h"
+#include "spi.h"
 
 #define SPI_FLASH_CS	0x30
-#define SPI_FLASH_CLK	0x15
-#define SPI_FLASH_DI	0x17 // data into the spi flash chip
-#define SPI_FLASH_DO	0x16 // data out of the spi flash chip
+
+#define SPI_WIP 0x01
+#define SPI_WEL 0x02
 
 void flash_init(void)
 {
 	pin_ddr(SPI_FLASH_CS, 1);
-	pin_ddr(SPI_FLASH_CLK, 1);
-	pin_ddr(SPI_FLASH_DI, 1);
-	pin_ddr(SPI_FLASH_DO, 0);
-
 	pin_write(SPI_FLASH_CS, 1);
+
+	spi_init(SPI_FLASH);
 }
 
 
 static void flash_write_byte(uint8_t x)
 {
-	spi_write(SPI_FLASH_CLK, SPI_FLASH_DI, 0, x);
+	spi_xfer(SPI_FLASH, x);
 }
 
 static uint8_t flash_read_byte(void)
 {
-	return spi_write(SPI_FLASH_CLK, 0, SPI_FLASH_DO, 0);
+	return spi_xfer(SPI_FLASH, 0);
 }
 
-void flash_read(uint32_t addr, void * buf_ptr, uint8_t len)
+// command byte followed by a 24-bit address
+static void flash_cmd(const uint8_t cmd, const uint32_t addr)
 {
-	uint8_t * buf = buf_ptr;
-
-	pin_write(SPI_FLASH_CS, 0);
-	flash_write_byte(0x03);
-	flash_write_byte((addr >> 16) & 0xFF);
-	flash_write_byte((addr >>  8) & 0xFF);
-	flash_write_byte((addr >>  0) & 0xFF);
-
-	for(uint8_t i = 0 ; i < len ; i++)
-		buf[i] = flash_read_byte();
-
-	pin_write(SPI_FLASH_CS, 1);
+	const uint8_t buf[] = {
+		cmd,
+		(addr >> 16) & 0xFF,
+		(addr >>  8) & 0xFF,
+		(addr >>  0) & 0xFF,
+	};
+
+	spi_xfer_buf(SPI_FLASH, buf, NULL, sizeof(buf));
 }
 
 uint8_t flash_status(void)
@@ -61,6 +57,40 @@ uint8_t flash_status(void)
 	return sr;
 }
 
+// everything except a status read is ignored during a program or erase
+static void flash_wait(void)
+{
+	while (flash_status() & SPI_WIP)
+		;
+}
+
+/*
+ * The read command keeps going through the memory for as long as the
+ * chip select is held, so a whole image can be read with one command.
+ */
+void flash_stream_start(uint32_t addr)
+{
+	flash_wait();
+	pin_write(SPI_FLASH_CS, 0);
+	flash_cmd(0x03, addr);
+}
+
+uint8_t flash_stream_read(void)
+{
+	return flash_read_byte();
+}
+
+void flash_stream_stop(void)
+{
+	pin_write(SPI_FLASH_CS, 1);
+}
+
+void flash_read(uint32_t addr, void * buf_ptr, uint8_t len)
+{
+	flash_stream_start(addr);
+	spi_xfer_buf(SPI_FLASH, NULL, buf_ptr, len);
+	flash_stream_stop();
+}
 
 void flash_wren()
 {
@@ -72,40 +102,79 @@ void flash_wren()
 
 void flash_erase(uint32_t addr)
 {
+	// write enable is ignored while a page program is still running
+	flash_flush();
+	flash_wait();
 	flash_wren();
 
 	pin_write(SPI_FLASH_CS, 0);
-	flash_write_byte(0x20);
-	flash_write_byte((addr >> 16) & 0xFF);
-	flash_write_byte((addr >>  8) & 0xFF);
-	flash_write_byte((addr >>  0) & 0xFF);
+	flash_cmd(0x20, addr);
 	pin_write(SPI_FLASH_CS, 1);
 
-#define SPI_WIP 0x01
-#define SPI_WEL 0x02
-
-	while (flash_status() & SPI_WIP)
-		;
+	flash_wait();
 }
 
-void flash_write(uint32_t addr, const void * buf_ptr, uint8_t len)
+/*
+ * The program runs in the background once the chip select goes high,
+ * so the next access waits for it to finish.  That also keeps the
+ * programs in order, which the image map depends on.
+ */
+void flash_write(uint32_t addr, const void * buf_ptr, uint16_t len)
 {
-	const uint8_t * buf = buf_ptr;
-
-	while (flash_status() & SPI_WIP)
-		;
-
+	flash_wait();
 	flash_wren();
 
 	pin_write(SPI_FLASH_CS, 0);
-	flash_write_byte(0x02);
-	flash_write_byte((addr >> 16) & 0xFF);
-	flash_write_byte((addr >>  8) & 0xFF);
-	flash_write_byte((addr >>  0) & 0xFF);
+	flash_cmd(0x02, addr);
+	spi_xfer_buf(SPI_FLASH, buf_ptr, NULL, len);
+	pin_write(SPI_FLASH_CS, 1);
+}
 
-	for(uint8_t i = 0 ; i < len ; i++)
-		flash_write_byte(buf[i]);
 
-	pin_write(SPI_FLASH_CS, 1);
+
+/*
+ * Consecutive writes within a page are collected in RAM and programmed
+ * together, since each program costs a write enable, status polls and
+ * a whole program cycle no matter how short it is.  The page is written
+ * when it is full, when a write does not follow on from the last one,
+ * or by flash_flush().  Anything still staged is lost on a reset, so
+ * callers flush before recording that the data is there.
+ */
+static uint8_t flash_stage_buf[FLASH_STAGE_SIZE] __attribute__((__aligned__(4)));
+static uint32_t flash_stage_addr;
+static uint16_t flash_stage_len;
+
+void flash_flush(void)
+{
+	if (flash_stage_len == 0)
+		return;
+
+	flash_write(flash_stage_addr, flash_stage_buf, flash_stage_len);
+	flash_stage_len = 0;
 }
 
+void * flash_stage_borrow(void)
+{
+	flash_flush();
+	return flash_stage_buf;
+}
+
+void flash_stage(uint32_t addr, const void * buf_ptr, uint8_t len)
+{
+	if (flash_stage_len != 0
+	&& (addr != flash_stage_addr + flash_stage_len
+	||  flash_stage_len + len > FLASH_STAGE_SIZE))
+		flash_flush();
+
+	if (flash_stage_len == 0)
+		flash_stage_addr = addr;
+
+	memcpy(flash_stage_buf + flash_stage_len, buf_ptr, len);
+	flash_stage_len += len;
+
+	// programs wrap within the page, so stop at the end of it
+	const uint32_t end = flash_stage_addr + flash_stage_len;
+	if (flash_stage_len == FLASH_STAGE_SIZE
+	|| (end & (FLASH_PAGE_SIZE - 1)) == 0)
+		flash_flush();
+}
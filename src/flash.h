@@ -6,6 +6,27 @@
 void flash_init(void);
 void flash_erase(uint32_t addr);
 void flash_read(uint32_t addr, void * buf, uint8_t len);
-void flash_write(uint32_t addr, const void * buf, uint8_t len);
+void flash_write(uint32_t addr, const void * buf, uint16_t len);
+
+// write-back staging of consecutive writes within a page, which are
+// only in the flash after flash_flush() or the next non-consecutive
+// write.  staging a whole page takes half of the RAM, so by default
+// it is half a page.
+#define FLASH_PAGE_SIZE 256
+#ifndef FLASH_STAGE_SIZE
+#define FLASH_STAGE_SIZE 128
+#endif
+
+void flash_stage(uint32_t addr, const void * buf, uint8_t len);
+void flash_flush(void);
+
+// flushes and lends out the FLASH_STAGE_SIZE byte buffer, which is
+// free until the next flash_stage(), see draw_list()
+void * flash_stage_borrow(void);
+
+// one long read, for as many bytes as needed
+void flash_stream_start(uint32_t addr);
+uint8_t flash_stream_read(void);
+void flash_stream_stop(void);
 
 #endif
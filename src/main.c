@@ -1,35 +1,31 @@
 #include <msp430.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 #include "epd.h"
 #include "flash.h"
+#include "draw.h"
 #include "radio.h"
+#include "timer.h"
 
 
 // incremented once per second
 static volatile uint16_t timer;
 
-// read the battery voltage via the Vcc/2 input to the ADC
-uint16_t battery_voltage(void)
+// convert one ADC input and turn it off again
+static uint16_t adc_read(const uint16_t ctl0, const uint16_t inch)
 {
-	// measure ADC channel 11 (Vcc/2) with 2.5V reference
-	// this is good for Vcc up to 5V, and the scale factor is 5.0/1024
-	// https://www.ti.com/lit/an/slaa828b/slaa828b.pdf
-	ADC10CTL0 = 0
-		| SREF_1	// Vr+ = Vref, Vr = Vss
-		| REF2_5V	// Vref = 2.5V
+	ADC10CTL0 = ctl0
 		| REFON		// Turn on the reference generator
-		| ADC10SHT_2	// 16 ADC clocks
 		| ADC10SR	// "reduces curennt consumption of buffer"
 		| ADC10ON	// turns on the ADC
 		;
 
-	ADC10CTL1 = 0
-		| INCH_11	// (Vcc-Vss)/2
+	ADC10CTL1 = inch
 		| SHS_0		// Sample-and-hold source ADC10SC bit
-		| ADC10DIV_0	// no ADC clock divider
-		//| ADC10SSEL_0	// ADC clock is ADC10OSC (0.131 mA)
-		| ADC10SSEL_2	// ADC clock is MCLK is lower power (0.026mA)
+		| ADC10DIV_3	// ADC10OSC/4, 0.9 to 1.6 MHz
+		| ADC10SSEL_0	// ADC clock is ADC10OSC (0.131 mA), since MCLK
+				// is 1 or 8 MHz and the sample times would follow it
 		;
 
 	// enable conversion and start conversion
@@ -45,10 +41,47 @@ uint16_t battery_voltage(void)
 	return ADC10MEM;
 }
 
+// read the battery voltage via the Vcc/2 input to the ADC
+uint16_t battery_voltage(void)
+{
+	// measure ADC channel 11 (Vcc/2) with 2.5V reference
+	// this is good for Vcc up to 5V, and the scale factor is 5.0/1024
+	// https://www.ti.com/lit/an/slaa828b/slaa828b.pdf
+	return adc_read(0
+		| SREF_1	// Vr+ = Vref, Vr = Vss
+		| REF2_5V	// Vref = 2.5V
+		| ADC10SHT_3	// 64 ADC clocks, over 40 us for REFON to settle
+		,
+		INCH_11		// (Vcc-Vss)/2
+	);
+}
+
+// read the internal temperature sensor, about 2.4 counts per degree C.
+// it is uncalibrated, but only the changes are used.
+static uint16_t temperature(void)
+{
+	return adc_read(0
+		| SREF_1	// Vr+ = Vref, Vr = Vss
+		| ADC10SHT_3	// 64 ADC clocks, over 40 us, the sensor needs 30 us
+		,
+		INCH_10		// temperature sensor, Vref = 1.5V
+	);
+}
+
 // re-generated during the build process
 #include "provision.h"
 
 
+// partial updates with the fast waveform leave some ghosting behind,
+// so a full refresh is done after this many of them
+#ifndef EPD_PARTIAL_LIMIT
+#define EPD_PARTIAL_LIMIT 8
+#endif
+
+// the display controller still holds the last image that was drawn
+static uint8_t epd_retained;
+static uint8_t epd_partials;
+
 // draws an RLE compressed image
 void draw_image(const uint8_t * image, uint16_t len, uint8_t invert)
 {
@@ -88,81 +121,356 @@ void draw_image(const uint8_t * image, uint16_t len, uint8_t invert)
 
 	epd_display();
 	epd_shutdown();
+	epd_retained = 0;
 }
 
 typedef struct {
 	uint32_t id;
 	uint8_t not_ready;
 	uint8_t need_draw;
-	uint8_t resv1;
-	uint8_t resv2;
-	uint32_t resv3;
-	uint32_t resv4;
+	uint8_t seq; // counts up with each new image, to find the newest slot
+	uint8_t format; // one of the IMG_FORMAT_ below
+	uint8_t blocks; // length of the image, 0xFF in older headers
+	radio_cal_t radio_cal; // the newest radio calibration when it was started
+	uint16_t cal_voltage; // and the battery_voltage()
+	uint16_t cal_temp; // and temperature() that it was found at
 	uint8_t map[16]; // offset 16
 	uint8_t data[]; // offset 32
 } flash_img_t;
 
+/*
+ * The images are a log across the whole flash, one per 4 KB sector.
+ * A new image goes into the sector after the newest one, so the erases
+ * are spread over all of them, and the older images stay around until
+ * the log wraps so that the tag can go back to one without downloading
+ * it again.  An interrupted image is restarted in the same slot with
+ * the same sequence number, so the live ones are always close enough
+ * together for the 8-bit compare.
+ */
+#define IMG_SLOTS 32
+#define IMG_SLOT_NONE IMG_SLOTS
+#define img_slot_addr(slot) ((uint32_t)(slot) << 12)
+
+static uint8_t img_slot;
+
+// rebuilt by img_init(), one bit for each slot with a complete image
+static uint32_t img_complete;
+
 static flash_img_t img;
-#define img_addr 0x0
+#define img_addr img_slot_addr(img_slot)
 #define img_map_offset 16
 #define img_data_offset 32
 
+// the image is sent in 32-byte blocks, one per data packet
+#define img_block_size 32
+#define img_size (EPD_HEIGHT * ((EPD_WIDTH + 7) / 8))
+#define img_blocks ((img_size + img_block_size - 1) / img_block_size)
+
+#define img_stride ((EPD_WIDTH + 7) / 8)
+
+// raw images are the bitmap as it is sent to the display,
+// the erased value so that older headers read as raw
+#define IMG_FORMAT_RAW 0xFF
+#define IMG_FORMAT_RLE 1
+#define IMG_FORMAT_DRAW 2 // a display list, see draw.h
+#define IMG_FORMAT_TEMPLATE 3 // field table and compressed bitmap, only drawn by lists
+#define IMG_FORMAT_CODED 4 // not an image, the coded blocks that are kept, see below
+
+// the map has blocks that are staged, but not yet marked in flash
+static uint8_t img_map_dirty;
+
+// coded blocks of the current image that are kept for later
+static uint8_t coded_pending;
+
+// rows of the image that have changed since it was last drawn
+static uint8_t img_dirty_first = 0xFF;
+static uint8_t img_dirty_last;
+
 // check to see if we have all the parts
 // note that a 1 means we have not yet received it, due flash polarity
-// todo: don't hardcode the number of parts
+static int img_map_complete(const uint8_t * const map)
+{
+	for(unsigned i = 0 ; i < img_blocks ; i++)
+		if (map[i >> 3] & (1 << (i & 7)))
+			return 0;
+
+	return 1;
+}
+
 static int img_check_complete(void)
 {
-	for(unsigned i = 0 ; i < 126 ; i++)
+	if (!img_map_complete(img.map))
 	{
-		const uint8_t b = img.map[i >> 3];
-		const uint8_t bit = 1 << (i & 7);
-
-		if ((b & bit) == 1)
-		{
-			img.not_ready = 1;
-			return 0;
-		}
+		img.not_ready = 1;
+		return 0;
 	}
 
 	img.not_ready = 0;
+	img_complete |= 1UL << img_slot;
 	return 1;
 }
 
 
-void img_init(const uint16_t flash_addr)
+void img_init(void)
 {
-	// the image is stored on a full flash page,
-	// along with some meta data that is fetched during the boot
-	flash_read(flash_addr, &img, sizeof(img));
+	// the newest image that has been started is the current one,
+	// or the erased header if there are none
+	flash_img_t hdr;
+	memset(&img, 0xFF, sizeof(img));
+	img_slot = 0;
+
+	for(uint8_t slot = 0 ; slot < IMG_SLOTS ; slot++)
+	{
+		flash_read(img_slot_addr(slot), &hdr, sizeof(hdr));
+		if (hdr.id == 0xFFFFFFFF || hdr.format == IMG_FORMAT_CODED)
+			continue;
+
+		if (img_map_complete(hdr.map))
+			img_complete |= 1UL << slot;
+
+		if (img.id != 0xFFFFFFFF && (int8_t)(hdr.seq - img.seq) <= 0)
+			continue;
+
+		img = hdr;
+		img_slot = slot;
+	}
 
 	img_check_complete();
 }
 
+// the newest slot with a complete copy of an image
+static uint8_t img_find(const uint32_t id)
+{
+	for(uint8_t i = 0 ; i < IMG_SLOTS ; i++)
+	{
+		const uint8_t slot = (img_slot + IMG_SLOTS - i) % IMG_SLOTS;
+		if (!(img_complete & (1UL << slot)))
+			continue;
 
-void img_draw(const uint16_t flash_addr)
+		uint32_t slot_id;
+		flash_read(img_slot_addr(slot), &slot_id, sizeof(slot_id));
+		if (slot_id == id)
+			return slot;
+	}
+
+	return IMG_SLOT_NONE;
+}
+
+// for the display list blits
+uint32_t img_bitmap(const uint32_t id, uint8_t * const rle)
 {
-	epd_setup();
-	epd_reset();
-	epd_init();
+	const uint8_t slot = img_find(id);
+	if (slot == IMG_SLOT_NONE)
+		return DRAW_NONE;
 
-	uint16_t addr = flash_addr + img_data_offset;
+	const uint32_t addr = img_slot_addr(slot) + img_data_offset;
+	uint8_t format;
+	flash_read(img_slot_addr(slot) + offsetof(flash_img_t, format), &format, 1);
 
-	epd_draw_start();
-	for(unsigned y = 0 ; y < EPD_HEIGHT ; y++)
+	*rle = format != IMG_FORMAT_RAW;
+	if (format == IMG_FORMAT_TEMPLATE)
+		return addr + sizeof(draw_template_t);
+	if (format == IMG_FORMAT_RAW || format == IMG_FORMAT_RLE)
+		return addr;
+
+	return DRAW_NONE;
+}
+
+/*
+ * The radio calibration is found once and kept in the image headers,
+ * so that it is written back at boot instead of taking half a second
+ * to find again.  It is only found again when the battery or the
+ * temperature has moved a long way from where it was found, or after
+ * a check in that heard nothing even at the slowest link setting, in
+ * case the radio has drifted off frequency.  That is done once until
+ * the gateway is heard again, so a gateway that is down doesn't cost
+ * a calibration every time.
+ */
+#define CAL_VOLTAGE_DELTA 41 // about 0.2V
+#define CAL_TEMP_DELTA 24 // about 10 C
+
+static radio_cal_t cal;
+static uint16_t cal_voltage;
+static uint16_t cal_temp;
+static uint8_t cal_stale;
+static uint8_t cal_lost;
+
+static uint16_t cal_diff(const uint16_t a, const uint16_t b)
+{
+	return a > b ? a - b : b - a;
+}
+
+// the newest header still has room for it if it was started before
+// there was one, otherwise it goes into the next image that is started
+static void cal_save(void)
+{
+	if (img.id == 0xFFFFFFFF || img.radio_cal.vco_current != 0xFF)
+		return;
+
+	img.radio_cal = cal;
+	img.cal_voltage = cal_voltage;
+	img.cal_temp = cal_temp;
+
+	const unsigned offset = offsetof(flash_img_t, radio_cal);
+	flash_write(img_addr + offset, &img.radio_cal, offsetof(flash_img_t, map) - offset);
+}
+
+// restore the calibration from the newest header, or find it if it
+// doesn't have one
+static void cal_init(void)
+{
+	cal = img.radio_cal;
+	cal_voltage = img.cal_voltage;
+	cal_temp = img.cal_temp;
+
+	radio_init(channel, &cal);
+
+	if (img.radio_cal.vco_current != 0xFF)
+		return;
+
+	cal_voltage = battery_voltage();
+	cal_temp = temperature();
+	cal_save();
+}
+
+static void cal_check(void)
+{
+	const uint16_t voltage = battery_voltage();
+	const uint16_t temp = temperature();
+
+	if (!cal_stale
+	&&  cal_diff(voltage, cal_voltage) < CAL_VOLTAGE_DELTA
+	&&  cal_diff(temp, cal_temp) < CAL_TEMP_DELTA)
+		return;
+
+	cal_stale = 0;
+	if (!radio_recalibrate(&cal))
+		return;
+
+	cal_voltage = voltage;
+	cal_temp = temp;
+	cal_save();
+}
+
+// start a new image at the head of the log, keeping the last complete
+// one and the keep slot, if there is one, for copying from.
+// compressed images are shorter, so the blocks past their end are
+// marked as received.
+static void img_start(const uint32_t id, const uint8_t format, const uint8_t blocks, const uint8_t keep)
+{
+	uint8_t seq = img.seq;
+	if (!img.not_ready)
 	{
-		// 128 bits of data
-		uint8_t data[(EPD_WIDTH + 7)/8];
+		seq++;
+		do {
+			img_slot = (img_slot + 1) % IMG_SLOTS;
+		} while (img_slot == keep);
+	}
+
+	memset(&img, 0xFF, sizeof(img));
+	img.id = id;
+	img.seq = seq;
+	coded_pending = 0;
+	img.format = format;
+	img.blocks = blocks;
+	img.radio_cal = cal;
+	img.cal_voltage = cal_voltage;
+	img.cal_temp = cal_temp;
+
+	for(unsigned i = blocks ; i < img_blocks ; i++)
+		img.map[i >> 3] &= ~(1 << (i & 7));
+
+	// all of it is new until a delta says otherwise
+	img_dirty_first = 0;
+	img_dirty_last = EPD_HEIGHT - 1;
+
+	// erase the old one, write in the new metadata
+	img_complete &= ~(1UL << img_slot);
+	flash_erase(img_addr);
+	flash_write(img_addr, &img, sizeof(img));
+	img_map_dirty = 0;
+}
+
+
+// decode a compressed image and send rows first to last to the display
+static void img_draw_rle(const uint8_t first, const uint8_t last)
+{
+	draw_rle_t r;
+	draw_rle_start(&r, img_addr + img_data_offset);
+
+	for(unsigned y = 0 ; y <= last ; y++)
+	{
+		draw_rle_row(&r);
+		if (y < first)
+			continue;
+
+		for(unsigned x = 0 ; x < img_stride ; x++)
+			epd_data_stream(r.row[x]);
+	}
+}
+
+/*
+ * Both bitmap draw paths hold the flash read and the display RAM write
+ * open for the whole frame.  They are on separate buses, so the bytes
+ * can go straight from one to the other.  Display lists are rendered
+ * a row at a time by draw.c instead.
+ */
+static void img_draw_stream(const uint8_t first, const uint8_t last)
+{
+	if (img.format == IMG_FORMAT_DRAW)
+	{
+		draw_list(img_addr + img_data_offset, img.blocks * img_block_size, first, last);
+		return;
+	}
+
+	const uint8_t rle = img.format == IMG_FORMAT_RLE;
+	flash_stream_start(img_addr + img_data_offset + (rle ? 0 : first * img_stride));
+	epd_data_start();
+
+	if (rle)
+		img_draw_rle(first, last);
+	else
+	for(uint16_t i = (last - first + 1) * img_stride ; i != 0 ; i--)
+		epd_data_stream(flash_stream_read());
+
+	epd_data_end();
+	flash_stream_stop();
+}
+
+void img_draw(void)
+{
+	uint8_t first = 0;
+	uint8_t last = EPD_HEIGHT - 1;
 
-		flash_read(addr, data, sizeof(data));
-		addr += sizeof(data);
+	epd_setup();
+	epd_reset();
 
-		for(unsigned x = 0 ; x < (EPD_WIDTH+7)/8 ; x++)
-			epd_data(data[x]);
+	if (epd_retained
+	&&  epd_partials < EPD_PARTIAL_LIMIT
+	&&  img_dirty_first <= img_dirty_last)
+	{
+		// only upload the rows that changed, with the fast waveform
+		first = img_dirty_first;
+		last = img_dirty_last;
+		epd_init_partial();
+		epd_partials++;
+	} else {
+		epd_init();
+		epd_partials = 0;
 	}
+
+	// the first image row is at the top of the RAM window
+	epd_set_frame(0, EPD_HEIGHT - 1 - last, EPD_WIDTH, last - first + 1);
+	img_draw_stream(first, last);
 	epd_display();
-	epd_shutdown();
+
+	// leave the controller powered so that it keeps the image
+	epd_sleep();
+	epd_retained = 1;
 
 	img.need_draw = 0;
+	img_dirty_first = 0xFF;
+	img_dirty_last = 0;
 }
 
 typedef struct {
@@ -171,13 +479,34 @@ typedef struct {
 	uint32_t githash;
 	uint32_t install_date;
 	uint16_t voltage;
-	uint16_t reserved;
+	uint16_t flags;
 	uint32_t img_id;
 	uint8_t img_map[16];
 }
 __attribute__((__packed__))
 msg_hello_t;
 
+// the tag can stay in RX for a burst of data packets
+#define HELLO_FLAG_BURST 1
+// the tag can build a new image from its current one
+#define HELLO_FLAG_DELTA 2
+// the tag can decode compressed images
+#define HELLO_FLAG_RLE 4
+// the tag listens for wake ups between check ins
+#define HELLO_FLAG_WOR 8
+// the tag can render display lists
+#define HELLO_FLAG_DRAW 16
+// the tag can store templates and fill in their fields
+#define HELLO_FLAG_TEMPLATE 32
+// the tag listens for wake ups on the group ID it was given
+#define HELLO_FLAG_GROUP 64
+// the tag can decode coded blocks
+#define HELLO_FLAG_CODED 128
+// the link setting that the tag listens with for the reply, see radio.h,
+// and a count of the hellos so the gateway can tell which one was lost
+#define HELLO_LINK(link) ((uint16_t)(link) << 8)
+#define HELLO_SEQ(seq) ((uint16_t)((seq) & 7) << 13)
+
 typedef struct {
 	uint32_t img_id;
 	uint16_t offset;
@@ -188,10 +517,656 @@ __attribute__((__packed__))
 msg_data_t;
 
 #define REPLY_FLAG_OK 1
+#define REPLY_FLAG_MORE 2 // another data packet follows in this burst
+#define REPLY_FLAG_DELTA 4 // data is a msg_delta_t for a new image
+#define REPLY_FLAG_RLE 8 // the image is compressed
+#define REPLY_FLAG_WAKE 16 // wake on radio packet, say hello when it ends
+#define REPLY_FLAG_DRAW 32 // the image is a display list
+#define REPLY_FLAG_TEMPLATE 64 // the image is a template
+#define REPLY_FLAG_GROUP 128 // with OK the data has our group ID, with WAKE a broadcast follows
+#define REPLY_BLOCKS(flags) ((flags) >> 8) // length if it isn't a raw image
+
+// data packets with this set in the offset are coded blocks, with the seed
+// of their set in the rest of it
+#define REPLY_OFFSET_CODED 0x8000
+
+// payload of a delta packet; changed uses the same polarity as the
+// image map, so it is the map of the new image once the unchanged
+// blocks have been copied over from the base.  the rows are the
+// ones that differ once it is drawn.
+typedef struct {
+	uint32_t base_id;
+	uint8_t changed[16];
+	uint8_t dirty_first;
+	uint8_t dirty_last;
+}
+__attribute__((__packed__))
+msg_delta_t;
+
+// milliseconds to wait for the gateway to answer a hello,
+// and between data packets in a burst
+#define HELLO_TIMEOUT 60
+#define BURST_TIMEOUT 20
+
+/*
+ * Tags can share a group ID, which the gateway gives out in its OK
+ * replies, so that it can send an image to all of them at once.  The
+ * wake ups are to the group ID when there is one, with the tag they
+ * are for in the data, or WAKE_ALL when a broadcast follows.  The
+ * tags that were woken for that say hello spread over BROADCAST_SLOTS
+ * of BROADCAST_SLOT_MS afterwards, so that they don't all collide.
+ * The first slot starts one slot after the broadcast, not at it.
+ */
+static uint32_t group_id;
+#define wake_id (group_id ? group_id : macaddr)
+#define WAKE_ALL 0xFFFFFFFF
+#define BROADCAST_SLOTS 64
+#define BROADCAST_SLOT_MS 32
+
+/*
+ * The gateway gives each tag a slot to check in, so that they take
+ * turns instead of colliding.  The OK reply has the time from then to
+ * the slot, and the time since the last OK that it sent, which the
+ * watchdog ticks since then are measured against to correct for the
+ * VLO, which can be anything from 4 to 20 kHz.  The ticks are counted
+ * from the reply, and the rest of the slot time is a radio_pause().
+ */
+typedef struct {
+	uint32_t group_id; // with REPLY_FLAG_GROUP
+	uint32_t slot_ms; // from this reply to our next check in, 0 for none
+	uint32_t elapsed_ms; // since the last OK, 0 if there wasn't one
+	uint16_t period; // seconds between check ins
+	uint8_t seq; // counts the OKs, to know if we missed one
+	uint8_t link; // for the next hello
+	uint8_t flags; // OK_FLAG_ below
+}
+__attribute__((__packed__))
+msg_ok_t;
+
+#define OK_FLAG_QUEUED 1 // the gateway has more for us, say hello again soon
+
+// times are kept in 1/256 of a watchdog tick, and the tick length in
+// 1/16 ms, which limits them to about 17 minutes
+#define CHECKIN_MAX_MS 1000000UL
+#define CHECKIN_TICKS 256 // without a schedule, about 12 minutes
+#define WDT_TICK_CYCLES 32768UL // WDT_ADLY_1000 on the VLO
+#define VLO_HZ 12000UL // nominal
+
+static uint32_t tick_len = WDT_TICK_CYCLES * 16000 / VLO_HZ;
+static uint16_t ok_tick; // timer at the last OK
+static uint32_t checkin_at = (uint32_t) CHECKIN_TICKS << 8; // from ok_tick
+static uint32_t checkin_period = (uint32_t) CHECKIN_TICKS << 8;
+static uint16_t checkin_tick;
+static uint8_t checkin_frac;
+static uint8_t checkin_due; // this hello is in our slot
+static uint8_t checkin_seq;
+
+/*
+ * The check ins are spread out when they aren't finding anything, so
+ * a tag whose label doesn't change is mostly asleep; the gateway
+ * wakes it up when there is a new one.  Each slot check in that only
+ * gets an OK doubles the number of periods to the next one, up to
+ * CHECKIN_QUIET_MAX, and a low battery stretches them further.  Each
+ * one that gets no reply at all doubles the wait for the next try.
+ * They stay on the slot, only skipping whole periods, so the gateway's
+ * schedule still holds.  An OK that says more is queued brings the
+ * next hello forward to CHECKIN_SOON ticks, once, and an incomplete
+ * image is asked for again after 1, 2, 4... ticks, until a hello gets
+ * some of it.
+ */
+#define CHECKIN_QUIET_MAX 3 // 8 periods, about 1.7 hours
+#define CHECKIN_SHIFT_MAX 5 // 32 periods, with a low battery
+#define CHECKIN_SOON 1
+#define CHECKIN_RETRY_MAX 8 // the same as CHECKIN_TICKS
+
+// battery_voltage() under which each is another doubling:
+// 2.7, 2.5 and 2.3V in 5/1024 V
+static const uint16_t checkin_volts[] = { 553, 512, 471 };
+
+static uint8_t checkin_quiet; // slot check ins with nothing new
+static uint8_t checkin_missed; // slot check ins with no reply
+static uint8_t checkin_news; // data or a wake up since the last OK
+static uint8_t checkin_soon;
+static uint8_t retry_shift;
+static uint16_t retry_tick;
+
+static void checkin_next(void)
+{
+	checkin_tick = ok_tick + (checkin_at >> 8);
+	checkin_frac = checkin_at;
+}
+
+static uint8_t checkin_shift(void)
+{
+	const uint16_t voltage = battery_voltage();
+	uint8_t shift = checkin_quiet;
+	for(uint8_t i = 0 ; i < sizeof(checkin_volts) / sizeof(*checkin_volts) ; i++)
+		if (voltage < checkin_volts[i])
+			shift++;
+
+	return shift < CHECKIN_SHIFT_MAX ? shift : CHECKIN_SHIFT_MAX;
+}
+
+// no reply in our slot, so try again some periods after it
+static void checkin_miss(void)
+{
+	checkin_at += checkin_period << checkin_missed;
+	if (checkin_missed < CHECKIN_SHIFT_MAX)
+		checkin_missed++;
+	checkin_next();
+}
+
+/*
+ * (ms << 12) / at in 32 bits, since a 64 bit division would pull a
+ * large helper into the image.  The remainder is shifted up six bits
+ * at a time, which is exact while at is under 2^26; that or a result
+ * that doesn't fit gives all ones, which is never a tick length.
+ */
+static uint32_t checkin_div(uint32_t ms, const uint32_t at)
+{
+	if (at == 0 || (at >> 26) != 0)
+		return 0xFFFFFFFF;
+
+	uint32_t q = ms / at;
+	if ((q >> 20) != 0)
+		return 0xFFFFFFFF;
+
+	ms %= at;
+	for(uint8_t i = 0 ; i < 2 ; i++)
+	{
+		ms <<= 6;
+		q = (q << 6) | (ms / at);
+		ms %= at;
+	}
+
+	return q;
+}
+
+static void checkin_schedule(const msg_ok_t * const ok)
+{
+	// start counting ticks from the reply
+	WDTCTL = WDT_ADLY_1000;
+	ok_tick = timer;
+
+	// if it was the hello in our slot, and we heard the last OK, then
+	// we know how many ticks that took, as well as how long it was
+	// after skipped periods that is more than 17 minutes
+	if (checkin_due
+	&&  ok->seq == (uint8_t)(checkin_seq + 1)
+	&&  ok->elapsed_ms != 0)
+	{
+		const uint32_t len = checkin_div(ok->elapsed_ms, checkin_at);
+		if (len > 16000 && len < 160000)
+			tick_len = len;
+	}
+
+	// nothing new in our slot, so the next one can wait longer
+	const uint8_t queued = ok->flags & OK_FLAG_QUEUED;
+	if (checkin_news || queued)
+		checkin_quiet = 0;
+	else
+	if (checkin_due && checkin_quiet < CHECKIN_QUIET_MAX)
+		checkin_quiet++;
+
+	checkin_seq = ok->seq;
+	checkin_due = 0;
+	checkin_news = 0;
+	checkin_missed = 0;
+
+	if (ok->slot_ms == 0 || ok->slot_ms >= CHECKIN_MAX_MS
+	||  ok->period * 1000UL >= CHECKIN_MAX_MS)
+	{
+		checkin_at = checkin_period = (uint32_t) CHECKIN_TICKS << 8;
+	} else {
+		checkin_at = (ok->slot_ms << 12) / tick_len;
+		checkin_period = ((uint32_t) ok->period * 1000 << 12) / tick_len;
+	}
+
+	checkin_at += (checkin_period << checkin_shift()) - checkin_period;
+	checkin_next();
+
+	// say hello again soon, then go back to the slot if that fails
+	checkin_soon = queued;
+	if (queued)
+	{
+		checkin_tick = ok_tick + CHECKIN_SOON;
+		checkin_frac = 0;
+		retry_shift = 0;
+		retry_tick = checkin_tick;
+	}
+}
+
+/*
+ * The gateway picks a link setting for each tag from how well the
+ * last ones went, and sends it in the OK.  Each hello goes out at the
+ * base rate and says which setting the tag is about to listen with,
+ * so both ends switch in step.  If there is no reply at all the tag
+ * drops to the slowest setting and tries again straight away.
+ */
+static uint8_t link_setting = RADIO_LINK_BASE;
+static uint8_t link_heard;
+static uint8_t hello_seq;
 
 static uint8_t msg_buf[40];
 
-int check_for_updates(uint32_t flash_addr)
+/*
+ * Program the staged blocks, then the map bits for them.  flash_write()
+ * waits for each program to finish before the next, so after a reset
+ * the map never says that a block is there before its data is.
+ */
+static void img_flush(void)
+{
+	flash_flush();
+
+	if (!img_map_dirty)
+		return;
+
+	flash_write(img_addr + img_map_offset, img.map, sizeof(img.map));
+	img_map_dirty = 0;
+}
+
+/*
+ * Copy the blocks that the map has as received from another slot,
+ * then write the map, so a reset part way through just leaves more
+ * blocks to be requested.
+ */
+static void img_copy(const uint8_t from, const uint8_t blocks)
+{
+	// the reply is no longer needed, so use its buffer for the copy
+	uint8_t * const buf = msg_buf;
+
+	for(unsigned i = 0 ; i < blocks ; i++)
+	{
+		if (img.map[i >> 3] & (1 << (i & 7)))
+			continue;
+
+		const uint16_t offset = img_data_offset + i * img_block_size;
+		flash_read(img_slot_addr(from) + offset, buf, img_block_size);
+		flash_stage(img_addr + offset, buf, img_block_size);
+	}
+
+	img_map_dirty = 1;
+	img_flush();
+	img_check_complete();
+}
+
+/*
+ * Go back to an image that is still in the log by copying it to the
+ * head, so that it is the newest one again, instead of downloading it.
+ */
+static void img_restore(const uint8_t slot)
+{
+	flash_img_t hdr;
+	flash_read(img_slot_addr(slot), &hdr, sizeof(hdr));
+
+	const uint8_t blocks = hdr.blocks < img_blocks ? hdr.blocks : img_blocks;
+	img_start(hdr.id, hdr.format, blocks, slot);
+	memset(img.map, 0, sizeof(img.map));
+	img_copy(slot, blocks);
+}
+
+// start the image that a data or delta packet is part of, returns the
+// number of blocks that it takes, or 0 if it was restored from the log
+static uint8_t img_start_reply(const msg_data_t * const reply, const uint8_t keep)
+{
+	const uint8_t slot = img_find(reply->img_id);
+	if (slot != IMG_SLOT_NONE)
+	{
+		img_restore(slot);
+		return 0;
+	}
+
+	uint8_t format = IMG_FORMAT_RAW;
+	uint8_t blocks = img_blocks;
+
+	if ((reply->flags & (REPLY_FLAG_RLE | REPLY_FLAG_DRAW | REPLY_FLAG_TEMPLATE))
+	&&  REPLY_BLOCKS(reply->flags) <= img_blocks)
+	{
+		if (reply->flags & REPLY_FLAG_TEMPLATE)
+			format = IMG_FORMAT_TEMPLATE;
+		else
+		if (reply->flags & REPLY_FLAG_DRAW)
+			format = IMG_FORMAT_DRAW;
+		else
+			format = IMG_FORMAT_RLE;
+		blocks = REPLY_BLOCKS(reply->flags);
+	}
+
+	img_start(reply->img_id, format, blocks, keep);
+	return blocks;
+}
+
+#define img_missing(i) (img.map[(i) >> 3] & (1 << ((i) & 7)))
+
+// stage one block of the image, from a data packet or decoded
+static void img_block(const uint8_t i, const uint8_t * const data)
+{
+	// note that this is negative logic, since erased flash is 1.
+	// the map in flash is only updated by img_flush()
+	img.map[i >> 3] &= ~(1 << (i & 7));
+	img_map_dirty = 1;
+
+	flash_stage(img_addr + img_data_offset + i * img_block_size, data, img_block_size);
+}
+
+/*
+ * Coded blocks are the XOR of a set of the image's blocks, which both
+ * ends pick from the seed in the packet's offset.  A broadcast sends
+ * them after the image itself, and each one fills in a block that a
+ * tag lost as long as it has all of the others in the set, whichever
+ * those are.  The sets are a stride through the next power of two
+ * above the length, skipping the blocks past its end, so they never
+ * have the same block twice.  server.py has the same generator.
+ */
+#define CODED_END 0xFF
+
+typedef struct {
+	uint8_t n; // left to step through
+	uint8_t i;
+	uint8_t step;
+	uint8_t mask;
+	uint8_t blocks;
+} coded_set_t;
+
+static const uint8_t coded_degrees[16] = {
+	1, 2, 2, 3, 3, 4, 4, 6, 6, 8, 8, 12, 16, 24, 32, 64,
+};
+
+static uint16_t coded_rand(uint16_t x)
+{
+	x ^= x << 7;
+	x ^= x >> 9;
+	x ^= x << 8;
+	return x;
+}
+
+static void coded_start(coded_set_t * const set, const uint16_t seed, const uint8_t blocks)
+{
+	uint8_t mask = 0;
+	while (mask < blocks - 1)
+		mask = (mask << 1) | 1;
+
+	uint16_t x = coded_rand(seed);
+	set->n = coded_degrees[x & 15];
+	if (set->n > mask)
+		set->n = mask + 1;
+
+	x = coded_rand(x);
+	set->i = x & mask;
+	x = coded_rand(x);
+	set->step = (x | 1) & mask;
+	set->mask = mask;
+	set->blocks = blocks;
+}
+
+static uint8_t coded_next(coded_set_t * const set)
+{
+	while (set->n != 0)
+	{
+		const uint8_t i = set->i;
+		set->n--;
+		set->i = (i + set->step) & set->mask;
+		if (i < set->blocks)
+			return i;
+	}
+
+	return CODED_END;
+}
+
+/*
+ * Coded blocks that are missing more than one of their set are kept
+ * until enough of the others arrive.  They go in the sector after the
+ * head of the log, which the next image will erase anyway, with a
+ * header that img_init() skips, then the seeds and the data after them.
+ * The seeds are zeroed once they have been used, so only the count is
+ * kept in RAM, and they are forgotten if the tag is reset.
+ */
+#define CODED_PENDING 120
+#define coded_addr img_slot_addr((img_slot + 1) % IMG_SLOTS)
+#define coded_seed_offset img_map_offset
+#define coded_data_offset 256
+
+// how many of the set we don't have, and the last of them
+static uint8_t img_coded_missing(const uint16_t seed, uint8_t * const last)
+{
+	coded_set_t set;
+	uint8_t count = 0;
+	uint8_t i;
+
+	coded_start(&set, seed, img.blocks);
+	while ((i = coded_next(&set)) != CODED_END)
+	{
+		if (!img_missing(i))
+			continue;
+		*last = i;
+		count++;
+	}
+
+	return count;
+}
+
+// xor in the ones that we do have, which leaves the missing one
+static void img_coded_xor(const uint16_t seed, uint8_t * const data)
+{
+	coded_set_t set;
+	uint8_t i;
+
+	// the blocks have to be in the flash to be read back
+	flash_flush();
+
+	coded_start(&set, seed, img.blocks);
+	while ((i = coded_next(&set)) != CODED_END)
+	{
+		if (img_missing(i))
+			continue;
+
+		flash_stream_start(img_addr + img_data_offset + i * img_block_size);
+		for(unsigned j = 0 ; j < img_block_size ; j++)
+			data[j] ^= flash_stream_read();
+		flash_stream_stop();
+	}
+}
+
+// returns 0 if it has to wait for more of its set
+static uint8_t img_coded_decode(const uint16_t seed, uint8_t * const data)
+{
+	uint8_t i = 0;
+	const uint8_t missing = img_coded_missing(seed, &i);
+	if (missing > 1)
+		return 0;
+
+	if (missing == 1)
+	{
+		img_coded_xor(seed, data);
+		img_block(i, data);
+	}
+
+	return 1;
+}
+
+// go through the kept ones again each time another block is decoded
+static void img_coded_pending(uint8_t * const buf)
+{
+	uint8_t progress = 1;
+	while (progress && img.not_ready)
+	{
+		progress = 0;
+		for(uint8_t n = 0 ; n < coded_pending ; n++)
+		{
+			uint16_t seed;
+			flash_read(coded_addr + coded_seed_offset + n * sizeof(seed), &seed, sizeof(seed));
+			uint8_t i;
+			if (seed == 0 || img_coded_missing(seed, &i) > 1)
+				continue;
+
+			flash_read(coded_addr + coded_data_offset + n * img_block_size, buf, img_block_size);
+			img_coded_decode(seed, buf);
+
+			seed = 0;
+			flash_write(coded_addr + coded_seed_offset + n * sizeof(seed), &seed, sizeof(seed));
+			progress = 1;
+			img_check_complete();
+		}
+	}
+}
+
+static void img_coded(const uint16_t seed, uint8_t * const data)
+{
+	if (img_coded_decode(seed, data))
+		return;
+	if (coded_pending == CODED_PENDING)
+		return;
+
+	// the oldest image in the log is lost once the first one is kept
+	if (coded_pending == 0)
+	{
+		static const uint32_t id = 0;
+		static const uint8_t format = IMG_FORMAT_CODED;
+
+		img_complete &= ~(1UL << ((img_slot + 1) % IMG_SLOTS));
+		flash_erase(coded_addr);
+		flash_write(coded_addr + offsetof(flash_img_t, id), &id, sizeof(id));
+		flash_write(coded_addr + offsetof(flash_img_t, format), &format, sizeof(format));
+	}
+
+	// the data goes in before the seed that says it is there
+	flash_write(coded_addr + coded_data_offset + coded_pending * img_block_size, data, img_block_size);
+	flash_write(coded_addr + coded_seed_offset + coded_pending * sizeof(seed), &seed, sizeof(seed));
+	coded_pending++;
+}
+
+// write one data packet into the image in flash
+static void img_store(msg_data_t * const reply)
+{
+	const uint8_t coded = (reply->offset & REPLY_OFFSET_CODED) != 0;
+
+	if (!coded
+	&& (reply->offset >= img_blocks * img_block_size
+	||  (reply->offset & (img_block_size - 1)) != 0))
+		return;
+
+	// nothing to store if it was already in the log
+	if (reply->img_id != img.id
+	&&  !img_start_reply(reply, IMG_SLOT_NONE))
+		return;
+
+	if (coded)
+		img_coded(reply->offset & ~REPLY_OFFSET_CODED, reply->data);
+	else
+	if (img_missing(reply->offset >> 5))
+		img_block(reply->offset >> 5, reply->data);
+	else
+		return;
+
+	// the packet has been staged, so its buffer is free
+	img_check_complete();
+	if (coded_pending)
+		img_coded_pending(reply->data);
+}
+
+/*
+ * Start a new image from one that we have, usually the current one,
+ * copying the unchanged blocks locally so that only the changed ones
+ * have to be sent.
+ */
+static void img_delta(const msg_data_t * const reply)
+{
+	const msg_delta_t * const delta = (const void*) reply->data;
+	const uint8_t base = img_find(delta->base_id);
+	if (base == IMG_SLOT_NONE)
+		return;
+
+	uint8_t changed[sizeof(img.map)];
+	memcpy(changed, delta->changed, sizeof(changed));
+	const uint8_t dirty_first = delta->dirty_first;
+	const uint8_t dirty_last = delta->dirty_last;
+
+	const uint8_t blocks = img_start_reply(reply, base);
+	if (!blocks)
+		return;
+
+	img_dirty_first = dirty_first;
+	img_dirty_last = dirty_last;
+
+	// blocks past the end of a compressed image stay marked as received
+	for(unsigned i = 0 ; i < sizeof(img.map) ; i++)
+		img.map[i] &= changed[i];
+
+	img_copy(base, blocks);
+}
+
+/*
+ * Stay in RX on id for as many data packets as the gateway streams.
+ * The radio is re-armed before each packet is staged, so the next one
+ * can arrive while a page is being programmed.  Returns 1 if another
+ * hello is needed to report the blocks that are still missing.
+ */
+static int img_rx(const uint32_t id, uint16_t timeout)
+{
+	msg_data_t * const reply = (void *) msg_buf;
+	int8_t rc;
+
+	radio_rx_start(id);
+
+	while((rc = radio_rx_wait((void*) reply, 40 /*sizeof(reply)*/, timeout)) != 0)
+	{
+		timeout = BURST_TIMEOUT;
+		link_heard = 1;
+
+		if (rc < 0)
+		{
+			// corrupted packet, the block will be reported as missing
+			radio_rx_start(id);
+			continue;
+		}
+
+		// the gateway is waking us up, say hello again once it stops
+		if (reply->flags & REPLY_FLAG_WAKE)
+		{
+			checkin_news = 1;
+			radio_wor_wait();
+			return 1;
+		}
+
+		// if they say everything is ok, then we go back to deep sleep
+		// until our next slot
+		if (reply->flags & REPLY_FLAG_OK)
+		{
+			const msg_ok_t * const ok = (const void *) reply->data;
+			if (reply->flags & REPLY_FLAG_GROUP)
+				group_id = ok->group_id;
+			link_setting = ok->link & (RADIO_LINK_RATE | RADIO_LINK_NOFEC | RADIO_LINK_POWER);
+			checkin_schedule(ok);
+			return 0;
+		}
+
+		checkin_news = 1;
+		retry_shift = 0;
+
+		// new image based on this one, then ask for the changed blocks
+		if (reply->flags & REPLY_FLAG_DELTA)
+		{
+			img_delta(reply);
+			return 1;
+		}
+
+		const uint8_t more = reply->flags & REPLY_FLAG_MORE;
+		if (more)
+			radio_rx_start(id);
+
+		img_store(reply);
+
+		// a broadcast keeps going for the tags that missed some
+		if (!more || !img.not_ready)
+			return 1;
+	}
+
+	// no reply to the hello, or the burst was cut short
+	return timeout == BURST_TIMEOUT;
+}
+
+// send a hello with our missing-block map and receive the reply
+static int check_for_updates_rx(void)
 {
 	msg_hello_t * const hello = (void*) msg_buf;
 	hello->tag_type = tag_type;
@@ -199,103 +1174,180 @@ int check_for_updates(uint32_t flash_addr)
 	hello->githash = githash;
 	hello->install_date = install_date;
 	hello->voltage = battery_voltage();
+	hello->flags = HELLO_FLAG_BURST | HELLO_FLAG_DELTA | HELLO_FLAG_RLE
+		| HELLO_FLAG_WOR | HELLO_FLAG_DRAW | HELLO_FLAG_TEMPLATE
+		| HELLO_FLAG_CODED | (group_id ? HELLO_FLAG_GROUP : 0)
+		| HELLO_LINK(link_setting) | HELLO_SEQ(++hello_seq);
 	hello->img_id = img.id;
 
 	memcpy(hello->img_map, img.map, sizeof(hello->img_map));
 
 	// send a ping?
+	radio_link(link_setting & RADIO_LINK_POWER);
 	radio_tx(gateway, (const void*) hello, 40); // sizeof(msg));
 
-	// todo: wait for some number of reply
-	msg_data_t * const reply = (void *) msg_buf;
-	if (radio_rx(macaddr, (void*) reply, 40 /*sizeof(reply)*/, 7500) != 1)
-		return 0;
+	radio_link(link_setting);
+	link_heard = 0;
+	const int again = img_rx(macaddr, HELLO_TIMEOUT);
 
-	// if they say everything is ok, then we go back to deep sleep
-	if (reply->flags & REPLY_FLAG_OK)
-		return 0;
+	radio_link(RADIO_LINK_BASE);
+	return again;
+}
 
-	// we have data!
-	if (reply->img_id != img.id)
-	{
-		// starting a new image
-		memset(&img, 0xFF, sizeof(img));
-		img.id = reply->img_id;
+int check_for_updates(void)
+{
+	cal_check();
+	int again = check_for_updates_rx();
 
-		// erase the old one, write in the new metadata
-		flash_erase(flash_addr);
-		flash_write(flash_addr, &img, sizeof(img));
+	if (!link_heard && link_setting != RADIO_LINK_SAFE)
+	{
+		link_setting = RADIO_LINK_SAFE;
+		again = check_for_updates_rx();
 	}
 
-	// the img_map stores based on 32-byte packets,
-	// so shift by 5 to find packet number, then by 3 to get byte into map
-	const uint16_t img_offset = reply->offset;
-	const uint8_t byte_num = (img_offset >> 5) >> 3;
-	const uint8_t bit_num = 1 << ((img_offset >> 5) & 7);
+	if (!link_heard && !cal_lost)
+		cal_stale = 1;
+	cal_lost = !link_heard;
 
-	// todo: validate byte_num, img_offset, etc
-	// note that this is negative logic, since 
-	img.map[byte_num] &= ~bit_num;
+	// the rest of the burst goes into the flash before the
+	// next hello reports it, or before it is drawn
+	img_flush();
+	return again;
+}
 
-	flash_write(flash_addr + img_data_offset + img_offset, reply->data, sizeof(reply->data));
+/*
+ * Woken up by the gateway: the packet might be for another tag in
+ * our group, for us, or for the whole group with the image following.
+ */
+static void img_woken(void)
+{
+	const msg_data_t * const wake = (const void *) msg_buf;
+	uint32_t dest;
+	memcpy(&dest, wake->data, sizeof(dest));
 
-	img_check_complete();
-	flash_write(flash_addr + img_map_offset + byte_num, &img.map[byte_num], 1);
+	if (dest != macaddr && dest != WAKE_ALL)
+		return;
 
-	return 1;
+	const uint8_t broadcast = (wake->flags & REPLY_FLAG_GROUP)
+		&& (wake->img_id != img.id || img.not_ready);
+
+	radio_wor_wait();
+
+	if (broadcast)
+	{
+		img_rx(group_id, HELLO_TIMEOUT);
+		img_flush();
+
+		const uint8_t slot = (macaddr ^ (macaddr >> 16)) % BROADCAST_SLOTS;
+		radio_pause((slot + 1) * BROADCAST_SLOT_MS);
+	}
+
+	while(check_for_updates())
+		;
 }
 
 int main(void)
 {
 	WDTCTL = WDTPW + WDTHOLD; // Stop WDT
+	timer_init();
+	clock_fast();
 
 	// init the flash and then load the image meta data
 	flash_init();
-	img_init(img_addr);
+	img_init();
 
 	// draw the boot screen, not the flash image for the first second
 	draw_image(bootscreen, bootscreen_len, !img.not_ready);
 
 	// configure the radio, then let it turn off again
-	radio_init(channel);
+	cal_init();
 	radio_sleep();
 
 	// setup the watchdog to trigger every three seconds or so
 	// not sure why this isn't once per second
-	BCSCTL3 = LFXT1S_2; // select VLO as the ACLK (used by the WDT)
 	WDTCTL = WDT_ADLY_1000;
 	IE1 |= WDTIE;
 	__enable_interrupt(); // GIE not set in LPM3 bits?
 
 	// let's do one check in before we sleep
-	while(check_for_updates(img_addr))
+	checkin_next();
+	while(check_for_updates())
 		;
+	radio_wor(wake_id);
 
 	while(1)
 	{
 		// go to sleep, to be woken up by the WDT interrupt in 3 seconds
+		// or by the radio if the gateway has a new image for us
+		clock_slow();
 		LPM3;
+		clock_fast();
+
+		const int8_t woken = radio_wor_woken(msg_buf, sizeof(msg_buf));
+		if (woken)
+		{
+			if (woken > 0)
+				img_woken();
+			radio_wor(wake_id);
+		}
 
 		// if the image is ready, then draw it and go back to sleep
 		if (!img.not_ready)
 		{
-			if (img.need_draw)
-				img_draw(img_addr);
-
-			// every so often, check in with the head node
-			// do so more often if we do not have a complete image
-			// watchdog triggers every 3s, so this is about
-			// once every 768 seconds
-			if ((timer & 0xff) != 0)
+			// templates stay in the flash for the lists that use
+			// them, the display keeps the last label until then
+			if (img.need_draw && img.format != IMG_FORMAT_TEMPLATE)
+				img_draw();
+
+			// check in with the head node in our slot, or
+			// sooner if it said that it has more for us
+			if ((int16_t)(timer - checkin_tick) < 0)
+				continue;
+
+			if (checkin_soon)
+			{
+				checkin_soon = 0;
+			} else {
+				// the rest of the tick.  the timer counts the same
+				// VLO as the watchdog, so this is that fraction of a
+				// tick however fast it runs, and tick_len isn't needed.
+				// there is none without a slot or before any reply.
+				if (checkin_frac)
+					radio_pause(checkin_frac * (WDT_TICK_CYCLES / 256) / (TIMER_VLO_HZ / 1000));
+				checkin_due = 1;
+			}
+		} else {
+			// ask for the rest of the image, less often
+			// each time that none of it arrives
+			if ((int16_t)(timer - retry_tick) < 0)
 				continue;
 		}
 
 		// the image is not ready or we need to do a period check in
-		while(check_for_updates(img_addr))
+		while(check_for_updates())
 			;
 
-		// turn the radio off before we go back to bed
-		radio_sleep();
+		if (checkin_due)
+		{
+			checkin_due = 0;
+			checkin_miss();
+		} else
+		if ((int16_t)(timer - checkin_tick) >= 0)
+		{
+			// the early hello wasn't answered, back to the slot
+			checkin_next();
+		}
+
+		if (img.not_ready)
+		{
+			retry_tick = timer + (1 << retry_shift);
+			if (retry_shift < CHECKIN_RETRY_MAX)
+				retry_shift++;
+		}
+
+		// turn the radio off before we go back to bed,
+		// except for listening for wake ups
+		radio_wor(wake_id);
 	}
 }
 
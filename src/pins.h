@@ -4,6 +4,30 @@
 #include <msp430.h>
 #include <stdint.h>
 
+#ifdef SIM
+/*
+ * Host build: every pin access goes into the peripheral models
+ * in sim/ so that they can watch chip selects and clock edges.
+ */
+void sim_pin_ddr(uint8_t port, int value);
+void sim_pin_write(uint8_t port, int value);
+uint8_t sim_pin_read(uint8_t port);
+
+static inline void pin_ddr(const uint8_t port, const int value)
+{
+	sim_pin_ddr(port, value);
+}
+
+static inline void pin_write(const uint8_t port, const int value)
+{
+	sim_pin_write(port, value);
+}
+
+static inline uint8_t pin_read(const uint8_t port)
+{
+	return sim_pin_read(port);
+}
+#else
 typedef struct {
 	volatile uint8_t * const ddr;
 	volatile const uint8_t * const in;
@@ -44,6 +68,7 @@ static inline uint8_t pin_read(const uint8_t port)
 	const uint8_t mask = 1 << (port & 0x7);
 	return (*p->in & mask) != 0;
 }
+#endif
 
 /*
  * Create a spi_write function for a specific pin and clock.
@@ -0,0 +1,8 @@
+const uint8_t channel = 4;
+const uint32_t tag_type = 0x02500120;
+const uint32_t gateway = 0xaed8e4fd;
+const uint32_t macaddr = 0x5a3c9d21;
+const uint32_t githash = 0x0bde9dc;
+const uint32_t install_date = 1700000000;
+const uint16_t bootscreen_len = 4;
+const uint8_t bootscreen[] = {0xff,0x7f,0xff,0x7f,};
@@ -15,13 +15,14 @@
  *
  */
 
-#include "pins.h"
+#include <msp430.h>
+#include "spi.h"
+#include "radio.h"
+#include "timer.h"
 
+// SCK, SDIO and GIO1 (as SDO) are on the USCI_A0 pins, see spi.h
 #define RADIO_IO2	0x10
-#define RADIO_IO1	0x11 // busy?
-#define RADIO_SDIO	0x12
 #define RADIO_SCS	0x13
-#define RADIO_SCK	0x14
 #define RADIO_POWER	0x27
 
 #define RADIO_CMD_SLEEP	0x80
@@ -72,6 +73,8 @@
 #define A7106_REG_ID 0x06
 
 #define A7106_REG_RCOSC1 0x07
+#define A7106_REG_RCOSC1_CALR BIT(7) // read
+#define A7106_REG_RCOSC1_RCOC 0x7F // read
 #define A7106_REG_RCOSC2 0x08
 #define A7106_REG_RCOSC3 0x09
 #define A7106_REG_RCOSC3_CALW BIT(3)
@@ -79,6 +82,10 @@
 #define A7106_REG_RCOSC3_TSEL BIT(1)
 #define A7106_REG_RCOSC3_WORMS BIT(0)
 
+#define A7106_REG_GIO2 0x0C
+#define A7106_REG_GIO2_WTR 0x01 // GIO2S=0000, output enabled
+#define A7106_REG_GIO2_WAK 0x11 // GIO2S=0100, output enabled
+
 #define A7106_REG_DATA_RATE 0x0e
 #define A7106_REG_PLL1 0x0F
 #define A7106_REG_PLL2 0x10
@@ -94,19 +101,37 @@
 #define A7106_REG_CODE1_IDL BIT(2)
 #define A7106_REG_CODE1_PML (BIT(1) | BIT(0))
 
+// DCL=001 and ETH=01 as recommended, the rest depends on the rate
+#define A7106_REG_CODE2 0x20
+#define A7106_REG_CODE2_FAST 0x16 // PMD=10, 8 bit preamble pattern for 250/500 Kbps
+#define A7106_REG_CODE2_SLOW 0x15 // PMD=01, 4 bits for 125 Kbps and below
+
 #define A7106_REG_IF_CALIBRATION1 0x22
 #define A7106_REG_IF_CALIBRATION1_MFBS	BIT(4) // write
 #define A7106_REG_IF_CALIBRATION1_FBCF	BIT(4) // read
+#define A7106_REG_IF_CALIBRATION1_FB	0x0F
 
 #define A7106_REG_IF_CALIBRATION2 0x23
 
 #define A7106_REG_VCO_CURRENT_CALIBRATION 0x24
 #define A7106_REG_VCO_CURRENT_CALIBRATION_MVCS BIT(4) // write
 #define A7106_REG_VCO_CURRENT_CALIBRATION_VCCF BIT(4) // read
+#define A7106_REG_VCO_CURRENT_CALIBRATION_VCB 0x0F
 
 #define A7106_REG_VCO_BAND_CALIBRATION 0x25
 #define A7106_REG_VCO_BAND_CALIBRATION_MVBS BIT(3) // write
 #define A7106_REG_VCO_BAND_CALIBRATION_VBCF BIT(3) // read
+#define A7106_REG_VCO_BAND_CALIBRATION_VB 0x07
+
+// writes the carrier detect threshold, reads the RSSI
+#define A7106_REG_RSSI 0x1D
+
+#define A7106_REG_TX_POWER 0x28
+
+// SLF=111 as recommended, and the DC estimation for the rate
+#define A7106_REG_RX_DEM_TEST1 0x29
+#define A7106_REG_RX_DEM_TEST1_FAST 0x47 // DCM=10, by ID for 250/500 Kbps
+#define A7106_REG_RX_DEM_TEST1_SLOW 0x27 // DCM=01, by preamble for 125 Kbps and below
 
 #define A7106_REG_CHARGE_PUMP 0x2b
 #define A7106_REG_CHARGE_PUMP_CPC0 BIT(0)
@@ -124,32 +149,20 @@ struct {
 	volatile uint16_t rx_error;
 	volatile uint16_t tx_count;
 	volatile uint16_t tx_error;
+	volatile uint16_t tx_busy; // the channel was in use before a tx
+	volatile uint16_t tx_backoff; // slots waited for it
+	volatile uint16_t tx_collision; // sent anyway after RADIO_LBT_TRIES
+	volatile uint8_t rssi; // the last reading
 } radio_stats;
 
 /*
- * busy loop delay, with their constant.
- */
-static void delay(uint16_t loops)
-{
-	for(uint16_t i = 0 ; i < loops ; i++)
-		for(uint16_t j = 0 ; j < 0x1D1 ; j++)
-			__asm__("");
-}
-
-/*
- * The radio is used in a three-wire mode, where the SDIO pin
- * switches directions for a read command.
- * This means that simultaneous bi-directional data is not supported,
- * although none of the protocol requires it.
+ * The radio is used in four-wire mode, with GIO1 as the data output,
+ * so that it can be driven by the USCI.  Reads still send the command
+ * byte first and then clock out the data.
  */
 static void radio_write_byte(uint8_t byte)
 {
-	spi_write(RADIO_SCK, RADIO_SDIO, 0, byte);
-}
-
-static uint8_t radio_read_byte(void)
-{
-	return spi_write(RADIO_SCK, 0, RADIO_IO1, 0);
+	spi_xfer(SPI_RADIO, byte);
 }
 
 static void radio_cs(uint8_t selected)
@@ -168,27 +181,16 @@ static void radio_reg_write_buf(const uint8_t cmd, const uint8_t * data, const u
 {
 	// should confirm that cmd doesn't have bit 7 set
 	radio_cs(1);
-	//pin_ddr(RADIO_SDIO, 1);
 	radio_write_byte(cmd & ~RADIO_READ_BIT);
-
-	for(unsigned i = 0 ; i < len ; i++)
-		radio_write_byte(data[i]);
-
+	spi_xfer_buf(SPI_RADIO, data, NULL, len);
 	radio_cs(0);
 }
 
 static void radio_reg_read_buf(const uint8_t cmd, uint8_t * data, const unsigned len)
 {
 	radio_cs(1);
-	//pin_ddr(RADIO_SDIO, 1);
 	radio_write_byte(cmd | RADIO_READ_BIT);
-
-	// use the same pin for input
-	//pin_ddr(RADIO_SDIO, 0);
-	for(unsigned i = 0 ; i < len ; i++)
-		data[i] = radio_read_byte();
-
-	//pin_ddr(RADIO_SDIO, 1);
+	spi_xfer_buf(SPI_RADIO, NULL, data, len);
 	radio_cs(0);
 }
 
@@ -206,6 +208,13 @@ static uint8_t radio_reg_read(const uint8_t cmd)
 
 static uint8_t radio_sleeping;
 
+// wake on radio is only used if the RC oscillator calibrated
+static uint8_t radio_wor_ok;
+static uint8_t radio_wor_on;
+
+// mode control register when wake on radio is off, see radio_init_cmd
+#define RADIO_MODE_CONTROL 0x62
+
 void radio_sleep(void)
 {
 	radio_strobe(RADIO_CMD_SLEEP);
@@ -218,12 +227,29 @@ void radio_wakeup(void)
 		return;
 
 	radio_sleeping = 0;
+
+	if (radio_wor_on)
+	{
+		// GIO2 goes back to WTR for the TX and RX that follow
+		radio_wor_on = 0;
+		P1IE &= ~BIT0;
+		radio_reg_write(A7106_REG_MODE_CONTROL, RADIO_MODE_CONTROL);
+		radio_reg_write(A7106_REG_GIO2, A7106_REG_GIO2_WTR);
+	}
+
 	radio_strobe(RADIO_CMD_STBY);
-	delay(1);
+	timer_sleep_us(1000);
 }
 
+static uint32_t radio_id;
+
 void radio_set_id(uint32_t id)
 {
+	// the ID register is retained in sleep, so only write it on changes
+	if (id == radio_id)
+		return;
+	radio_id = id;
+
 	uint8_t id_buf[] = {
 		(id >> 24) & 0xFF,
 		(id >> 16) & 0xFF,
@@ -255,7 +281,7 @@ void radio_set_id(uint32_t id)
  * 5. After calibration done, FBC, VCC and VBC is auto clear.
  * 6. Check pass or fail by reading calibration flag (FBCF) and (VCCF, VBCF).
  */
-static int radio_calibrate(void)
+static int radio_calibrate(radio_cal_t * const cal)
 {
  	// 3. Set A7106 in PLL mode.
 	// radio_strobe(RADIO_CMD_PLL);
@@ -266,7 +292,7 @@ static int radio_calibrate(void)
         radio_reg_write(0x25, 0x00); // Set MVBS = 0
 	radio_strobe(RADIO_CMD_PLL);
 
-	delay(400);
+	timer_sleep_ms(400);
 
 	// 4. Enable IF Filter Bank (set FBC, RSSC=1), VCO Current (VCC=1), and VCO Bank (VBC=1).
 	radio_reg_write(A7106_REG_CALC, 0
@@ -289,28 +315,83 @@ static int radio_calibrate(void)
 	}
 
 	// 6. Check pass or fail by reading calibration flag (FBCF) and (VCCF, VBCF).
-	if (radio_reg_read(A7106_REG_IF_CALIBRATION1) & A7106_REG_IF_CALIBRATION1_FBCF)
+	const uint8_t fb = radio_reg_read(A7106_REG_IF_CALIBRATION1);
+	if (fb & A7106_REG_IF_CALIBRATION1_FBCF)
 	{
 		radio_status = 2;
 		return 0;
 	}
 
-	if (radio_reg_read(A7106_REG_VCO_CURRENT_CALIBRATION) & A7106_REG_VCO_CURRENT_CALIBRATION_VCCF)
+	const uint8_t vcb = radio_reg_read(A7106_REG_VCO_CURRENT_CALIBRATION);
+	if (vcb & A7106_REG_VCO_CURRENT_CALIBRATION_VCCF)
 	{
 		radio_status = 3;
 		return 0;
 	}
 
-	if (radio_reg_read(A7106_REG_VCO_BAND_CALIBRATION) & A7106_REG_VCO_BAND_CALIBRATION_VBCF)
+	const uint8_t vb = radio_reg_read(A7106_REG_VCO_BAND_CALIBRATION);
+	if (vb & A7106_REG_VCO_BAND_CALIBRATION_VBCF)
 	{
 		radio_status = 4;
 		return 0;
 	}
 
+	cal->vco_current = vcb & A7106_REG_VCO_CURRENT_CALIBRATION_VCB;
+	cal->vco_band = vb & A7106_REG_VCO_BAND_CALIBRATION_VB;
+	cal->if_filter = fb & A7106_REG_IF_CALIBRATION1_FB;
+	return 1;
+}
+
+/*
+ * The manual select bits make the radio use the values that are
+ * written with them instead of its own calibration, which is how the
+ * cached results are put back without the PLL settling and the
+ * calibration cycle.
+ */
+static uint8_t radio_cal_restore(const radio_cal_t * const cal)
+{
+	if (cal->vco_current > A7106_REG_VCO_CURRENT_CALIBRATION_VCB
+	||  cal->vco_band > A7106_REG_VCO_BAND_CALIBRATION_VB
+	||  cal->if_filter > A7106_REG_IF_CALIBRATION1_FB)
+		return 0;
+
+	radio_reg_write(A7106_REG_IF_CALIBRATION1, A7106_REG_IF_CALIBRATION1_MFBS | cal->if_filter);
+	radio_reg_write(A7106_REG_VCO_CURRENT_CALIBRATION, A7106_REG_VCO_CURRENT_CALIBRATION_MVCS | cal->vco_current);
+	radio_reg_write(A7106_REG_VCO_BAND_CALIBRATION, A7106_REG_VCO_BAND_CALIBRATION_MVBS | cal->vco_band);
+	return 1;
+}
+
+uint8_t radio_recalibrate(radio_cal_t * const cal)
+{
+	radio_wakeup();
+
+	radio_cal_t new_cal;
+	if (!radio_calibrate(&new_cal))
+	{
+		// the radio is left in auto, so go back to the old ones
+		radio_cal_restore(cal);
+		radio_strobe(RADIO_CMD_STBY);
+		return 0;
+	}
+
+	*cal = new_cal;
+	radio_strobe(RADIO_CMD_STBY);
 	return 1;
 }
 
 
+/*
+ * Wake on radio timing: the radio listens for (WOR_AC+1)/4096 seconds
+ * every (WOR_SL+1)/128 seconds on its own RC oscillator, so about 4 ms
+ * every 2 s, which costs 16 mA * 0.2% = 32 uA on average.  The gateway
+ * repeats its wake packet for a little over two periods, so that there
+ * are two chances to hear it, and the tag waits that long after a wake
+ * up before saying hello.
+ */
+#define RADIO_WOR_SL 255
+#define RADIO_WOR_AC 15
+#define RADIO_WOR_WAKE_MS 4200
+
 /* Chapter 20.1
  * 1. Set A7106 in standby mode.
  * 2. Select either GIO1 or GIO2 pin to wake up MCU.
@@ -328,12 +409,37 @@ static int radio_calibrate(void)
  */
 static int radio_osc_setup(void)
 {
-	for(unsigned i = 0 ; i < 4 ; i++)
+	// 3. listen for WOR_AC every WOR_SL
+	radio_reg_write(A7106_REG_RCOSC1, RADIO_WOR_SL & 0xFF);
+	radio_reg_write(A7106_REG_RCOSC2, (RADIO_WOR_SL >> 8) << 6 | RADIO_WOR_AC);
+
+	for(uint8_t rcot = 0 ; rcot < 4 ; rcot++)
 	{
-		radio_reg_write(A7106_REG_RCOSC3, 0);
-		radio_reg_write(A7106_REG_RCOSC3, (i << 4) | A7106_REG_RCOSC3_CALW | A7106_REG_RCOSC3_TSEL);
+		// 4. RCOT is stepped up until the calibration value is in range
+		radio_reg_write(A7106_REG_RCOSC3, 0
+			| rcot << 4
+			| A7106_REG_RCOSC3_CALW
+			| A7106_REG_RCOSC3_EN
+		);
+
+		// 5. wait for CALR to clear
+		uint8_t rcosc;
+		unsigned count = 200;
+		while ((rcosc = radio_reg_read(A7106_REG_RCOSC1)) & A7106_REG_RCOSC1_CALR)
+		{
+			if (--count == 0)
+			{
+				radio_status = 5;
+				return 0;
+			}
+		}
+
+		// 6. RCOC >= 0x14 is good enough
+		if ((rcosc & A7106_REG_RCOSC1_RCOC) >= 0x14)
+			return 1;
 	}
 
+	radio_status = 6;
 	return 0;
 }
 
@@ -345,7 +451,7 @@ static void radio_channel(const uint8_t value)
 
 #define RADIO_SPEED_2 0xF9
 #define RADIO_SPEED_10 0x31
-#define RADIO_SPEED_25 0x09
+#define RADIO_SPEED_50 0x09
 #define RADIO_SPEED_100 0x04
 #define RADIO_SPEED_125 0x03
 #define RADIO_SPEED_250 0x01
@@ -353,11 +459,17 @@ static void radio_channel(const uint8_t value)
 
 static void radio_speed(uint8_t speed, uint8_t fec, uint8_t crc)
 {
-	// speeds are 2, 50, 125, 250 or 500 Kbps
+	// 500 Kbps divided by speed + 1
 	// default is 500 Kbps with a divisor of 1
 	// 16MHz input clock, GCS=0, DBL=1, CSC=01, RRC=00, CHR=1111
 	radio_reg_write(A7106_REG_DATA_RATE, speed);
 
+	// the preamble detection and DC estimation change with the rate,
+	// see the code register II (20h) and RX DEM test I (29h) tables
+	const uint8_t slow = speed >= RADIO_SPEED_125;
+	radio_reg_write(A7106_REG_CODE2, slow ? A7106_REG_CODE2_SLOW : A7106_REG_CODE2_FAST);
+	radio_reg_write(A7106_REG_RX_DEM_TEST1, slow ? A7106_REG_RX_DEM_TEST1_SLOW : A7106_REG_RX_DEM_TEST1_FAST);
+
 	radio_reg_write(A7106_REG_CODE1, 0
 		| (fec ? A7106_REG_CODE1_FECS : 0)
 		| (crc ? A7106_REG_CODE1_CRCS : 0)
@@ -366,6 +478,37 @@ static void radio_speed(uint8_t speed, uint8_t fec, uint8_t crc)
 	);
 }
 
+/*
+ * Link settings, see radio.h.  The powers are PAC and TBG from the
+ * table in chapter 19, with TXCS=0.
+ */
+static const uint8_t radio_link_speed[4] = {
+	RADIO_SPEED_500,
+	RADIO_SPEED_250,
+	RADIO_SPEED_125,
+	RADIO_SPEED_100,
+};
+
+static const uint8_t radio_link_power[4] = {
+	0x17, // PAC=2 TBG=7, 0.08 dBm at 19.0 mA, as in radio_init_cmd
+	0x0B, // PAC=1 TBG=3, -10.18 dBm at 13.1 mA, the recommended low power one
+	0x1F, // PAC=3 TBG=7, 1.35 dBm at 21.9 mA, the most it has
+	0x17,
+};
+
+static uint8_t radio_link_now;
+
+void radio_link(const uint8_t link)
+{
+	if (link == radio_link_now)
+		return;
+
+	radio_link_now = link;
+	radio_wakeup();
+	radio_speed(radio_link_speed[link & RADIO_LINK_RATE], !(link & RADIO_LINK_NOFEC), 1);
+	radio_reg_write(A7106_REG_TX_POWER, radio_link_power[(link & RADIO_LINK_POWER) >> 3]);
+}
+
 static void radio_fifo_reset(const uint8_t len)
 {
 	radio_reg_write(A7106_REG_FIFO_END, len - 1);
@@ -374,20 +517,95 @@ static void radio_fifo_reset(const uint8_t len)
 }
 
 /*
- * Port 1 pin 1 is mapped to the IO1 pin from the radio
- * This is controlled by the GIO1 register.
- * 0x0b, 0x01, // GIO1 pin control: TX End of access code / RX FSYNC
- *
- * In TX Mode, it goes high when transmitting and low when the packet is done.
- *
- * In RX mode, it outputs the FSYNC (Frame Sync) signal.
- * FSYNC goes high when the ID code has been matched, and then low
- * when the packet is complete.
+ * WTR on P1.0 falls at the end of a TX or RX, which raises a port 1
+ * interrupt.  The timeout is timer_wait(), so the MCU can wait in
+ * LPM3.  The VLO is only roughly 12 KHz, so the timeouts are not
+ * precise.
  */
+#define RADIO_TX_TIMEOUT 10
 
-static uint8_t radio_busy(void)
+static volatile uint8_t radio_done;
+
+void __attribute__((interrupt(PORT1_VECTOR)))
+radio_wtr_interrupt(void)
 {
-	return pin_read(RADIO_IO2);
+	P1IFG &= ~BIT0;
+	radio_done = 1;
+	LPM3_EXIT;
+}
+
+// clear the flag before the strobe, so that only this packet sets it
+static void radio_wtr_arm(void)
+{
+	radio_done = 0;
+	P1IES |= BIT0;
+	P1IFG &= ~BIT0;
+	P1IE |= BIT0;
+}
+
+// sleep until WTR falls or the timeout, returns 1 if it fell
+static uint8_t radio_wait(const uint16_t timeout_ms)
+{
+	return timer_wait(&radio_done, timeout_ms);
+}
+
+/*
+ * Sleep between check ins, but keep listening for the gateway.
+ * WAK is on GIO2 in place of WTR, so it raises the same interrupt,
+ * except that it rises when a packet for our ID arrives.
+ * Steps 2 and 7 of chapter 20.1, the rest is done by radio_init().
+ */
+void radio_wor(uint32_t id)
+{
+	if (!radio_wor_ok)
+	{
+		radio_sleep();
+		return;
+	}
+
+	radio_wakeup();
+	radio_set_id(id);
+	radio_reg_write(A7106_REG_GIO2, A7106_REG_GIO2_WAK);
+
+	radio_done = 0;
+	P1IES &= ~BIT0;
+	P1IFG &= ~BIT0;
+	P1IE |= BIT0;
+
+	radio_reg_write(A7106_REG_MODE_CONTROL, RADIO_MODE_CONTROL | A7106_REG_MODE_CONTROL_WORE);
+	radio_wor_on = 1;
+	radio_sleeping = 1;
+}
+
+// sleep with the radio off until the next radio_tx() or rx
+void radio_pause(const uint16_t ms)
+{
+	radio_sleep();
+	radio_done = 0;
+	P1IE &= ~BIT0;
+	radio_wait(ms);
+}
+
+/*
+ * The gateway keeps sending its wake packet for two periods, so
+ * that has to be waited out before saying hello, otherwise it would
+ * not be listening.
+ */
+void radio_wor_wait(void)
+{
+	radio_pause(RADIO_WOR_WAKE_MS);
+}
+
+static int8_t radio_rx_read(uint8_t * buf, uint8_t max_len);
+
+// returns 1 if the gateway woke us up, with the wake packet in buf
+int8_t radio_wor_woken(uint8_t * buf, uint8_t max_len)
+{
+	if (!radio_wor_on || !radio_done)
+		return 0;
+
+	radio_wakeup();
+	return radio_rx_read(buf, max_len);
 }
 
 
@@ -410,19 +628,12 @@ static int8_t radio_tx_buf(const uint8_t *buf, const unsigned len)
 	radio_fifo_reset(len);
 	radio_reg_write_buf(A7106_REG_FIFO_DATA, buf, len);
 
-	//delay(500);
+	radio_wtr_arm();
 	radio_strobe(RADIO_CMD_TX);
 	radio_stats.tx_count++;
 
-	//delay(1000);
-
-	delay(1);
-
-	for(unsigned i = 0 ; i < 64 ; i++)
-	{
-		if (!radio_busy())
-			return 0;
-	}
+	if (radio_wait(RADIO_TX_TIMEOUT))
+		return 0;
 
 	radio_stats.tx_error++;
 	return -1;
@@ -486,74 +697,119 @@ static const uint8_t radio_init_cmd[] = {
 };
 
 
-void radio_init(uint8_t channel)
+void radio_init(uint8_t channel, radio_cal_t * const cal)
 {
-	pin_ddr(RADIO_IO1, 0);
 	pin_ddr(RADIO_IO2, 0);
-	pin_ddr(RADIO_SDIO, 1);
-	pin_ddr(RADIO_SCK, 1);
 	pin_ddr(RADIO_SCS, 1);
 
 	pin_write(RADIO_SCS, 1);
+	spi_init(SPI_RADIO);
 
 	// send all of our initial register states
-	// first is a reset
+	// first is a reset, which also clears the ID
+	radio_id = 0;
 	for(unsigned i = 0 ; i < sizeof(radio_init_cmd) ; i+=2)
 		radio_reg_write(radio_init_cmd[i+0], radio_init_cmd[i+1]);
 
-	if (!radio_calibrate()
-	&&  !radio_calibrate()
-	&&  !radio_calibrate())
+	// frequency = 2400 MHz + channel * 500 KHz
+	// looks like maybe (G?)FSK at ~350 KHz separation
+	// set before calibrating, since the VCO band is for this frequency
+	radio_channel(channel);
+
+	if (!radio_cal_restore(cal))
 	{
-		// we tried.  we really tried.
-		return;
-	}
+		if (!radio_calibrate(cal)
+		&&  !radio_calibrate(cal)
+		&&  !radio_calibrate(cal))
+		{
+			// we tried.  we really tried.
+			return;
+		}
 
-	delay(100);
+		timer_sleep_ms(100);
+	}
 
-	// wake on radio is not yet configured, so it is not calibrated
-	if (0)
-	if (!radio_osc_setup())
-		return;
+	// wake on radio falls back to sleep if this fails
+	radio_wor_ok = radio_osc_setup();
 
-	// high speed, FEC + CRC
-	if (0)
-		radio_speed(RADIO_SPEED_500, 1, 1);
+	// radio_init_cmd is the base link, 500 Kbps with FEC + CRC
+	radio_link_now = RADIO_LINK_BASE;
 	//radio_reg_write(A7106_REG_FIFO2, 0x00); // FPM=0, PSA=0
 
-	// frequency = 2400 MHz + channel * 500 KHz
-	// looks like maybe (G?)FSK at ~350 KHz separation
-	radio_channel(channel);
-
 	return;
 }
 
+/*
+ * Listen before talk: the receiver is on for long enough for the auto
+ * RSSI measurement to settle, and if the carrier detect flag says that
+ * another tag or the gateway is using the channel, the radio sleeps for
+ * a random number of slots, with the window doubling each time, before
+ * trying again.  After RADIO_LBT_TRIES it is sent anyway.  The random
+ * numbers are stirred with the RSSI readings, whose low bits are noise,
+ * so that tags that woke together don't back off in step.
+ */
+#define RADIO_LBT_TRIES 5
+#define RADIO_LBT_LISTEN_MS 1
+#define RADIO_LBT_SLOT_MS 8
+
+static uint16_t radio_rand = 1;
+
+static uint8_t radio_busy(void)
+{
+	radio_done = 0;
+	P1IE &= ~BIT0;
+	radio_strobe(RADIO_CMD_RX);
+	radio_wait(RADIO_LBT_LISTEN_MS);
+
+	const uint8_t busy = radio_reg_read(A7106_REG_MODE_CONTROL) & A7106_REG_MODE_CONTROL_CD;
+	const uint8_t rssi = radio_reg_read(A7106_REG_RSSI);
+	radio_strobe(RADIO_CMD_STBY);
+
+	radio_stats.rssi = rssi;
+	radio_rand ^= rssi;
+	radio_rand ^= radio_rand << 7;
+	radio_rand ^= radio_rand >> 9;
+	radio_rand ^= radio_rand << 8;
+
+	return busy;
+}
+
+static void radio_lbt(void)
+{
+	for(uint8_t i = 0 ; i < RADIO_LBT_TRIES ; i++)
+	{
+		if (!radio_busy())
+			return;
+
+		const uint8_t slots = 1 + (radio_rand & ((2 << i) - 1));
+		radio_stats.tx_busy++;
+		radio_stats.tx_backoff += slots;
+		radio_pause(slots * RADIO_LBT_SLOT_MS);
+		radio_wakeup();
+	}
+
+	radio_stats.tx_collision++;
+}
+
 int8_t radio_tx(uint32_t id, const uint8_t * buf, uint8_t len)
 {
 	radio_wakeup();
 	radio_set_id(id);
+	radio_lbt();
 	return radio_tx_buf(buf, len);
 }
 
-int8_t radio_rx(uint32_t id, uint8_t * buf, uint8_t max_len, uint16_t timeout)
+void radio_rx_start(uint32_t id)
 {
 	radio_wakeup();
 	radio_set_id(id);
 
+	radio_wtr_arm();
 	radio_strobe(RADIO_CMD_RX);
-	//delay(1);
-
-	// wait for WTR to go low, indicating rx complete
-	for(uint16_t spin = 0 ; radio_busy() ; spin++)
-	{
-		if (spin < timeout)
-			continue;
-
-		// cancel the RX
-		radio_strobe(RADIO_CMD_STBY);
-		return 0;
-	}
+}
 
+static int8_t radio_rx_read(uint8_t * buf, uint8_t max_len)
+{
 	// check the CRC and FEC registers
 	const uint8_t status = radio_reg_read(A7106_REG_MODE);
 	if (status & (A7106_REG_MODE_CRCF | A7106_REG_MODE_FECF))
@@ -568,3 +824,21 @@ int8_t radio_rx(uint32_t id, uint8_t * buf, uint8_t max_len, uint16_t timeout)
 	radio_stats.rx_count++;
 	return 1;
 }
+
+int8_t radio_rx_wait(uint8_t * buf, uint8_t max_len, uint16_t timeout)
+{
+	if (!radio_wait(timeout))
+	{
+		// cancel the RX
+		radio_strobe(RADIO_CMD_STBY);
+		return 0;
+	}
+
+	return radio_rx_read(buf, max_len);
+}
+
+int8_t radio_rx(uint32_t id, uint8_t * buf, uint8_t max_len, uint16_t timeout)
+{
+	radio_rx_start(id);
+	return radio_rx_wait(buf, max_len, timeout);
+}
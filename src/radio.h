@@ -3,11 +3,62 @@
 
 #include <stdint.h>
 
-void radio_init(uint8_t channel);
+/*
+ * The results of the VCO current, VCO band and IF filter calibration,
+ * which take the radio half a second to find.  They are kept so that
+ * they can be written back instead, and only found again when the
+ * temperature or battery has moved a long way.  0xFF is none.
+ */
+typedef struct {
+	uint8_t vco_current;
+	uint8_t vco_band;
+	uint8_t if_filter;
+} radio_cal_t;
+
+// restores the calibration in cal, or calibrates and fills it in
+void radio_init(uint8_t channel, radio_cal_t * cal);
 void radio_sleep(void);
 
-void radio_tx(uint32_t dest, const uint8_t * buf, uint8_t len);
+// returns 1 with the new results in cal, or 0 if it failed
+uint8_t radio_recalibrate(radio_cal_t * cal);
+
+// listens before it talks, and backs off while the channel is busy
+int8_t radio_tx(uint32_t dest, const uint8_t * buf, uint8_t len);
 
 int8_t radio_rx(uint32_t my_id, uint8_t * buf, uint8_t max_len, uint16_t timeout);
 
+// split receive, so that the next packet can arrive while the last is
+// processed.  wait returns straight away if it already has, otherwise
+// it sleeps for up to timeout milliseconds, and returns 1 for a packet,
+// 0 for none and -1 for a corrupted one.
+void radio_rx_start(uint32_t my_id);
+int8_t radio_rx_wait(uint8_t * buf, uint8_t max_len, uint16_t timeout);
+
+// sleep, but listen every couple of seconds for a wake up from the
+// gateway.  woken returns 1 once one has arrived, with the packet in
+// buf, or -1 if it was corrupted; wait sleeps until the gateway has
+// finished sending it.  the radio stays asleep until the next tx.
+void radio_wor(uint32_t my_id);
+int8_t radio_wor_woken(uint8_t * buf, uint8_t max_len);
+void radio_wor_wait(void);
+
+// sleep for ms with the radio off
+void radio_pause(uint16_t ms);
+
+/*
+ * Link settings for the data phase, which the gateway chooses for
+ * each tag.  The rate and FEC have to match at both ends, the power
+ * is only what we transmit at.  Zero is what radio_init() sets up,
+ * which hellos, wake ups and broadcasts always use.
+ */
+#define RADIO_LINK_RATE 0x03 // 500, 250, 125 or 100 Kbps
+#define RADIO_LINK_NOFEC 0x04
+#define RADIO_LINK_POWER 0x18
+#define RADIO_LINK_LOW 0x08 // about -10 dBm
+#define RADIO_LINK_HIGH 0x10 // about +1 dBm
+#define RADIO_LINK_BASE 0x00
+#define RADIO_LINK_SAFE (0x03 | RADIO_LINK_HIGH) // the slowest
+
+void radio_link(uint8_t link);
+
 #endif
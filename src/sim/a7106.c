@@ -0,0 +1,416 @@
+/*
+ * A7106 register file model.
+ *
+ * Models the 4-wire SPI command set (strobes, register reads and
+ * writes, the easy FIFO and the ID register), the WTR or WAK output
+ * on GIO2, wake on radio, and enough of the calibration registers for
+ * radio_calibrate() and radio_osc_setup() to pass.  Packets leave and
+ * arrive through the air link in air.c.
+ */
+#include <stdint.h>
+#include <string.h>
+#include "sim.h"
+
+#define A7106_MODE_SLEEP	0x8
+#define A7106_MODE_IDLE		0x9
+#define A7106_MODE_STBY		0xA
+#define A7106_MODE_PLL		0xB
+#define A7106_MODE_RX		0xC
+#define A7106_MODE_TX		0xD
+#define A7106_WRITE_FIFO_RESET	0xE
+#define A7106_READ_FIFO_RESET	0xF
+
+// sim time from the strobe until WTR falls, about a millisecond
+// for a 40 byte packet at 500 Kbps with FEC, which is 7 bits for 4
+#define TX_TIME		12
+#define RX_TIME		12
+
+#define REG_MODE_CONTROL_WORE	0x08
+#define REG_GIO2_WAK		0x11
+
+// calibrated RC oscillator value, anything from 0x14 is good
+#define RCOC		0x28
+
+static uint8_t regs[0x40];
+static uint8_t id[4];
+static uint8_t fifo[64];
+static uint8_t fifo_ptr;
+static uint8_t mode = A7106_MODE_SLEEP;
+
+static uint8_t cmd;
+static uint8_t byte_num;
+
+static int rx_pending;
+
+// WTR is high until this time, or forever if nothing is coming
+static int wtr;
+static unsigned long long wtr_done;
+
+// wake on radio listens for wor_active ticks after every wor_sleep,
+// WAK stays high from a wake up until the next strobe
+static int wor;
+static unsigned long long wor_start;
+static unsigned long long wor_sleep;
+static unsigned long long wor_active;
+static int wak;
+static unsigned long long wor_missed;
+
+static struct {
+	uint64_t strobes;
+	uint64_t reg_writes;
+	uint64_t reg_reads;
+	uint64_t calibrations;
+	uint64_t cal_restores;
+	uint64_t tx_packets;
+	uint64_t rx_packets;
+	uint64_t rx_timeouts;
+	uint64_t rx_time;
+	uint64_t rc_calibrations;
+	uint64_t wor_windows;
+	uint64_t wor_wakes;
+} stats;
+
+static unsigned long long rx_since;
+
+// what the current mode costs
+static void energy_mode(void)
+{
+	switch(mode)
+	{
+	case A7106_MODE_IDLE: energy_set(ENERGY_RADIO_IDLE); break;
+	case A7106_MODE_STBY: energy_set(ENERGY_RADIO_STBY); break;
+	case A7106_MODE_PLL: energy_set(ENERGY_RADIO_PLL); break;
+	case A7106_MODE_RX: energy_set(ENERGY_RADIO_RX); break;
+	case A7106_MODE_TX:
+		energy_set(air_power(regs[0x28]) < -5
+			? ENERGY_RADIO_TX_LOW : ENERGY_RADIO_TX);
+		break;
+	default: energy_set(ENERGY_RADIO_SLEEP); break;
+	}
+}
+
+// keep track of how long the receiver is on
+static void set_mode(const uint8_t new_mode)
+{
+	if (mode != A7106_MODE_RX && new_mode == A7106_MODE_RX)
+		rx_since = sim_now;
+	if (mode == A7106_MODE_RX && new_mode != A7106_MODE_RX)
+		stats.rx_time += sim_now - rx_since;
+	mode = new_mode;
+	energy_mode();
+}
+
+static void wor_begin(void)
+{
+	// sleep is (WOR_SL+1)/128 s and listening (WOR_AC+1)/4096 s
+	const unsigned sl = regs[0x07] | (regs[0x08] >> 6) << 8;
+	const unsigned ac = regs[0x08] & 0x3F;
+
+	wor = 1;
+	wor_start = sim_now;
+	wor_missed = 0;
+	wor_sleep = (sl + 1) * SIM_VLO_HZ / 128;
+	wor_active = (ac + 1) * SIM_VLO_HZ / 4096;
+
+	// it sleeps between the listen windows
+	energy_set(ENERGY_RADIO_SLEEP);
+}
+
+// listen windows that have started so far count as receive time,
+// the first one is after a whole sleep period
+static void wor_end(void)
+{
+	if (!wor)
+		return;
+
+	const unsigned long long windows = sim_now < wor_start + wor_sleep ? 0
+		: (sim_now - wor_start - wor_sleep) / (wor_sleep + wor_active) + 1;
+	stats.wor_windows += windows;
+	stats.rx_time += windows * wor_active;
+	energy_add(ENERGY_RADIO_RX, (double) windows * wor_active / sim_vlo_hz);
+	wor = 0;
+	energy_mode();
+}
+
+static uint32_t radio_id(void)
+{
+	return 0
+		| (uint32_t) id[0] << 24
+		| (uint32_t) id[1] << 16
+		| (uint32_t) id[2] <<  8
+		| (uint32_t) id[3] <<  0;
+}
+
+// the data rate is 500 Kbps / (SDR + 1)
+static unsigned long long air_time(const unsigned long long base)
+{
+	return base * (regs[0x0E] + 1) * (regs[0x1F] & 0x10 ? 7 : 4) / 7;
+}
+
+static void strobe(const uint8_t cmd)
+{
+	const uint8_t len = regs[0x03] + 1;
+
+	stats.strobes++;
+	wak = 0;
+
+	// an RX that is cancelled before a packet arrived timed out
+	if (mode == A7106_MODE_RX && !rx_pending && cmd != A7106_MODE_RX)
+		stats.rx_timeouts++;
+
+	switch(cmd)
+	{
+	case A7106_WRITE_FIFO_RESET:
+	case A7106_READ_FIFO_RESET:
+		fifo_ptr = 0;
+		return;
+	case A7106_MODE_TX:
+		stats.tx_packets++;
+		air_tx(radio_id(), fifo, len, regs[0x0E], regs[0x1F], regs[0x28]);
+		set_mode(A7106_MODE_TX);
+		wtr = 1;
+		wtr_done = sim_now + air_time(TX_TIME);
+		return;
+	case A7106_MODE_RX:
+		set_mode(A7106_MODE_RX);
+		rx_pending = air_rx(radio_id(), fifo, len, regs[0x0E], regs[0x1F]);
+		fifo_ptr = 0;
+		wtr = 1;
+		wtr_done = rx_pending ? sim_now + air_time(RX_TIME) : SIM_NEVER;
+		return;
+	default:
+		set_mode(cmd);
+		rx_pending = 0;
+		wtr = 0;
+		return;
+	}
+}
+
+static void reg_write(const uint8_t addr, const uint8_t value, const uint8_t n)
+{
+	stats.reg_writes++;
+
+	switch(addr)
+	{
+	case 0x00:
+		// software reset
+		memset(regs, 0, sizeof(regs));
+		set_mode(A7106_MODE_STBY);
+		wor_end();
+		return;
+	case 0x01:
+		if (value & REG_MODE_CONTROL_WORE)
+		{
+			if (!wor)
+				wor_begin();
+		} else
+			wor_end();
+		regs[addr] = value;
+		return;
+	case 0x02:
+		// calibration completes immediately and always passes,
+		// with the same IF filter, VCO current and VCO band
+		if (value & 0x0F)
+			stats.calibrations++;
+		regs[0x22] = 0x06;
+		regs[0x24] = 0x03;
+		regs[0x25] = 0x02;
+		return;
+	case 0x22:
+		// manual IF filter bank, when a calibration is put back
+		if (value & 0x10)
+			stats.cal_restores++;
+		regs[addr] = value;
+		return;
+	case 0x05:
+		fifo[fifo_ptr++ & 0x3F] = value;
+		return;
+	case 0x09:
+		// so does the RC oscillator calibration
+		if (value & 0x08)
+			stats.rc_calibrations++;
+		regs[addr] = value;
+		return;
+	case 0x06:
+		// data bytes start at n=1
+		if (n >= 1 && n <= sizeof(id))
+			id[n - 1] = value;
+		return;
+	default:
+		regs[addr] = value;
+		return;
+	}
+}
+
+static uint8_t reg_read(const uint8_t addr, const uint8_t n)
+{
+	stats.reg_reads++;
+
+	switch(addr)
+	{
+	case 0x00:
+		// no CRC or FEC errors, the air link drops bad packets
+		return 0;
+	case 0x02:
+		return 0;
+	case 0x05:
+		return fifo[fifo_ptr++ & 0x3F];
+	case 0x06:
+		// value for data byte n+1
+		return n < sizeof(id) ? id[n] : 0;
+	case 0x07:
+		// CALR is clear and RCOC is in range
+		return RCOC;
+	case 0x01:
+		// carrier detect, when something else is on the air
+		return regs[addr] | (mode == A7106_MODE_RX && air_busy() ? 0x10 : 0);
+	case 0x1D:
+		// the RSSI, with the noise in its low bits
+		return regs[addr] ^ (sim_now & 3);
+	default:
+		return regs[addr];
+	}
+}
+
+static void a7106_select(int selected)
+{
+	if (selected)
+		byte_num = 0;
+}
+
+static uint8_t a7106_xfer(uint8_t in)
+{
+	const uint8_t n = byte_num++;
+
+	if (n == 0)
+	{
+		cmd = in;
+
+		if (cmd & 0x80)
+		{
+			strobe(cmd >> 4);
+			return 0xFF;
+		}
+
+		if (cmd & 0x40)
+			return reg_read(cmd & 0x3F, n);
+
+		return 0xFF;
+	}
+
+	if (cmd & 0x80)
+		return 0xFF;
+
+	if (cmd & 0x40)
+		return reg_read(cmd & 0x3F, n);
+
+	reg_write(cmd & 0x3F, in, n);
+	return 0xFF;
+}
+
+sim_spi_t a7106_spi = {
+	.name = "radio",
+	.cs = 0x13,
+	.clk = 0x14,
+	.mosi = 0x12,
+	.select = a7106_select,
+	.xfer = a7106_xfer,
+};
+
+/*
+ * WTR is high while a TX or RX is in progress.  TX completes after
+ * the air time of the packet; RX completes after the air time if the
+ * air link had a packet for our ID, otherwise it stays high until the
+ * firmware gives up and strobes standby.
+ */
+static uint8_t a7106_wtr(void)
+{
+	if (!wtr)
+		return 0;
+
+	if (sim_now < wtr_done)
+		return 1;
+
+	if (mode == A7106_MODE_RX)
+		stats.rx_packets++;
+
+	set_mode(A7106_MODE_STBY);
+	rx_pending = 0;
+	wtr = 0;
+	return 0;
+}
+
+/*
+ * With wake on radio the first listen window is after one sleep
+ * period.  The air link decides which windows overlap a packet that
+ * the gateway is repeating for our ID.
+ */
+static unsigned long long wor_next(void)
+{
+	if (!wor)
+		return SIM_NEVER;
+
+	// skip a window that was on the air but lost
+	const unsigned long long after = wor_missed && wor_missed == sim_now
+		? sim_now + 1 : sim_now;
+
+	return air_wake_next(radio_id(), after,
+		wor_start + wor_sleep, wor_sleep + wor_active, wor_active);
+}
+
+// WAK rises when a listen window receives a packet, then WOR stops
+static uint8_t a7106_wak(void)
+{
+	if (wak || !wor || sim_now < wor_next())
+		return wak;
+
+	if (!air_wake_rx(radio_id(), fifo, regs[0x03] + 1, wor_active))
+	{
+		wor_missed = sim_now;
+		return 0;
+	}
+
+	wor_end();
+	regs[0x01] &= ~REG_MODE_CONTROL_WORE;
+	fifo_ptr = 0;
+	stats.wor_wakes++;
+	stats.rx_packets++;
+	wak = 1;
+	return 1;
+}
+
+static int gio2_wak(void)
+{
+	return regs[0x0C] == REG_GIO2_WAK;
+}
+
+unsigned long long a7106_gio2_next(void)
+{
+	if (gio2_wak())
+		return wak ? SIM_NEVER : wor_next();
+
+	return wtr ? wtr_done : SIM_NEVER;
+}
+
+uint8_t a7106_gio2(void)
+{
+	return gio2_wak() ? a7106_wak() : a7106_wtr();
+}
+
+void a7106_report(FILE * f)
+{
+	wor_end();
+
+	fprintf(f, "radio_strobes %llu\n", (unsigned long long) stats.strobes);
+	fprintf(f, "radio_reg_writes %llu\n", (unsigned long long) stats.reg_writes);
+	fprintf(f, "radio_reg_reads %llu\n", (unsigned long long) stats.reg_reads);
+	fprintf(f, "radio_calibrations %llu\n", (unsigned long long) stats.calibrations);
+	fprintf(f, "radio_cal_restores %llu\n", (unsigned long long) stats.cal_restores);
+	fprintf(f, "radio_tx_packets %llu\n", (unsigned long long) stats.tx_packets);
+	fprintf(f, "radio_rx_packets %llu\n", (unsigned long long) stats.rx_packets);
+	fprintf(f, "radio_rx_timeouts %llu\n", (unsigned long long) stats.rx_timeouts);
+	fprintf(f, "radio_rx_ms %.1f\n", stats.rx_time * 1000.0 / SIM_VLO_HZ);
+	fprintf(f, "radio_rc_calibrations %llu\n", (unsigned long long) stats.rc_calibrations);
+	fprintf(f, "radio_wor_windows %llu\n", (unsigned long long) stats.wor_windows);
+	fprintf(f, "radio_wor_wakes %llu\n", (unsigned long long) stats.wor_wakes);
+}
@@ -0,0 +1,436 @@
+/*
+ * Over the air link between the simulated tag and a gateway process.
+ *
+ * The gateway is normally server.py started with --sim, which swaps
+ * the A7106 for a radio that speaks this framing on stdin/stdout:
+ *
+ *	uint32_t id (little endian), uint8_t len, uint8_t data[len]
+ *
+ * A frame with id 0 and no data from the gateway means that it is
+ * back in blocking_receive(), so everything it sent in response to
+ * the last tag packet has been queued.  That keeps the two sides in
+ * lock step and the runs repeatable.
+ *
+ * A frame with id 0 and a 16-bit length in milliseconds means that
+ * the next frame is sent over and over for that long, which is how
+ * the gateway wakes up a tag that is in wake on radio.  Those can be
+ * heard by a listen window at any time until they end.
+ *
+ * Each packet to the gateway follows a frame with id 0, the tag's
+ * time in milliseconds and the signed RSSI in dBm, so that the gateway
+ * runs on simulated time.
+ *
+ * A frame with id 0 and three bytes from the gateway is the data rate,
+ * code and TX power registers that it uses from then on.  Packets are
+ * only heard if the rate and FEC match at both ends.
+ *
+ * Packets are dropped in both directions with a seeded random loss,
+ * and more of them as the signal gets close to the sensitivity for the
+ * rate, which is a rough model: -90 dBm at 500 Kbps with FEC, 3 dB
+ * better each time the rate halves and 2 dB worse without FEC.  The
+ * channel can also be busy when the tag listens before it talks.
+ */
+#define _DEFAULT_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+
+#define MAX_FRAMES	512
+
+typedef struct {
+	uint32_t id;
+	uint8_t len;
+	uint8_t data[64];
+	uint8_t rate;
+	uint8_t code;
+	uint8_t power;
+	unsigned long long start;
+	unsigned long long until;
+} frame_t;
+
+static frame_t queue[MAX_FRAMES];
+static unsigned queue_head;
+static unsigned queue_tail;
+
+static FILE * to_gateway;
+static FILE * from_gateway;
+
+static unsigned loss;
+static uint32_t rand_state;
+static unsigned busy;
+static uint32_t busy_state = 1;
+
+// dB between the tag and the gateway
+static unsigned atten = 60;
+
+// the gateway's data rate, code and TX power registers
+static uint8_t gw_rate = 0x00;
+static uint8_t gw_code = 0x1F;
+static uint8_t gw_power = 0x37;
+
+static struct {
+	uint64_t tx_packets;
+	uint64_t tx_bytes;
+	uint64_t rx_packets;
+	uint64_t rx_bytes;
+	uint64_t lost;
+	uint64_t missed;
+	uint64_t busy;
+	uint64_t faded;
+	uint64_t mismatched;
+} stats;
+
+void air_loss(unsigned percent, unsigned seed)
+{
+	loss = percent;
+	rand_state = seed ? seed : 1;
+}
+
+void air_atten(unsigned db)
+{
+	atten = db;
+}
+
+static uint32_t air_rand(void)
+{
+	// xorshift32 so that runs repeat for a given seed
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+	return rand_state;
+}
+
+// dBm for the TX power register values that radio.c and the gateway use
+int air_power(const uint8_t reg)
+{
+	switch(reg)
+	{
+	case 0x1F: return 1;
+	case 0x37: return 1; // TXCS=1 isn't in the datasheet's table
+	case 0x0B: return -10;
+	default: return 0;
+	}
+}
+
+static int air_rssi(const uint8_t power)
+{
+	return air_power(power) - (int) atten;
+}
+
+// percent of the packets lost to noise, none from 4 dB over the sensitivity
+static unsigned air_fade(const int rssi, const uint8_t rate, const uint8_t code)
+{
+	int sensitivity = -90;
+	for(unsigned n = rate + 1 ; n > 1 ; n >>= 1)
+		sensitivity -= 3;
+	if ((code & 0x10) == 0)
+		sensitivity += 2;
+
+	const int margin = rssi - sensitivity;
+	if (margin >= 4)
+		return 0;
+	if (margin <= -4)
+		return 100;
+	return (4 - margin) * 100 / 8;
+}
+
+static int air_lost(const unsigned fade)
+{
+	if (air_rand() % 100 < loss)
+	{
+		stats.lost++;
+		return 1;
+	}
+
+	if (fade && air_rand() % 100 < fade)
+	{
+		stats.faded++;
+		return 1;
+	}
+
+	return 0;
+}
+
+void air_busy_set(unsigned percent)
+{
+	busy = percent;
+}
+
+// another transmitter, separate from the losses so that those repeat
+int air_busy(void)
+{
+	busy_state ^= busy_state << 13;
+	busy_state ^= busy_state >> 17;
+	busy_state ^= busy_state << 5;
+
+	if (busy_state % 100 >= busy)
+		return 0;
+
+	stats.busy++;
+	return 1;
+}
+
+static int read_frame(frame_t * const f)
+{
+	uint8_t hdr[5];
+	if (fread(hdr, sizeof(hdr), 1, from_gateway) != 1)
+		return 0;
+
+	f->id = hdr[0] | hdr[1] << 8 | hdr[2] << 16 | (uint32_t) hdr[3] << 24;
+	f->len = hdr[4] > sizeof(f->data) ? sizeof(f->data) : hdr[4];
+	memset(f->data, 0, sizeof(f->data));
+
+	if (hdr[4] && fread(f->data, f->len, 1, from_gateway) != 1)
+		return 0;
+
+	return 1;
+}
+
+/*
+ * Queue everything the gateway transmits until it is listening again.
+ */
+static void air_sync(void)
+{
+	frame_t f;
+	unsigned repeat_ms = 0;
+
+	while (from_gateway)
+	{
+		if (!read_frame(&f))
+		{
+			fprintf(stderr, "air: gateway exited\n");
+			from_gateway = NULL;
+			return;
+		}
+
+		if (f.id == 0 && f.len == 0)
+			return;
+
+		if (f.id == 0 && f.len == 2)
+		{
+			repeat_ms = f.data[0] | f.data[1] << 8;
+			continue;
+		}
+
+		if (f.id == 0 && f.len == 3)
+		{
+			gw_rate = f.data[0];
+			gw_code = f.data[1];
+			gw_power = f.data[2];
+			continue;
+		}
+
+		f.rate = gw_rate;
+		f.code = gw_code;
+		f.power = gw_power;
+		f.start = sim_now;
+		f.until = sim_now + (unsigned long long) repeat_ms * sim_vlo_hz / 1000;
+		repeat_ms = 0;
+
+		if (queue_tail - queue_head == MAX_FRAMES)
+		{
+			stats.missed++;
+			continue;
+		}
+
+		queue[queue_tail++ % MAX_FRAMES] = f;
+	}
+}
+
+void air_start(const char * cmd)
+{
+	int to[2], from[2];
+	if (pipe(to) < 0 || pipe(from) < 0)
+	{
+		perror("pipe");
+		exit(EXIT_FAILURE);
+	}
+
+	const pid_t pid = fork();
+	if (pid < 0)
+	{
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pid == 0)
+	{
+		dup2(to[0], 0);
+		dup2(from[1], 1);
+		close(to[0]); close(to[1]);
+		close(from[0]); close(from[1]);
+		execl("/bin/sh", "sh", "-c", cmd, (char*) NULL);
+		perror(cmd);
+		_exit(EXIT_FAILURE);
+	}
+
+	close(to[0]);
+	close(from[1]);
+	to_gateway = fdopen(to[1], "wb");
+	from_gateway = fdopen(from[0], "rb");
+
+	// wait for the gateway to be ready to receive
+	air_sync();
+}
+
+void air_tx(uint32_t id, const uint8_t * buf, uint8_t len, uint8_t rate, uint8_t code, uint8_t power)
+{
+	stats.tx_packets++;
+	stats.tx_bytes += len;
+
+	// anything the tag did not listen for is gone
+	stats.missed += queue_tail - queue_head;
+	queue_head = queue_tail;
+
+	if (!to_gateway || !from_gateway)
+		return;
+
+	if (rate != gw_rate || (code ^ gw_code) & 0x10)
+	{
+		stats.mismatched++;
+		return;
+	}
+
+	const int rssi = air_rssi(power);
+	if (air_lost(air_fade(rssi, rate, code)))
+		return;
+
+	const uint32_t ms = sim_now * 1000 / sim_vlo_hz;
+	const uint8_t now[] = { 0, 0, 0, 0, 5, ms >> 0, ms >> 8, ms >> 16, ms >> 24, (uint8_t) rssi };
+	fwrite(now, sizeof(now), 1, to_gateway);
+
+	const uint8_t hdr[] = { id >> 0, id >> 8, id >> 16, id >> 24, len };
+	fwrite(hdr, sizeof(hdr), 1, to_gateway);
+	fwrite(buf, len, 1, to_gateway);
+	fflush(to_gateway);
+
+	air_sync();
+}
+
+int air_rx(uint32_t id, uint8_t * buf, uint8_t len, uint8_t rate, uint8_t code)
+{
+	while (queue_head != queue_tail)
+	{
+		const frame_t * const f = &queue[queue_head % MAX_FRAMES];
+
+		// the radio filters on the ID before the packet arrives
+		if (f->id != id)
+		{
+			queue_head++;
+			stats.missed++;
+			continue;
+		}
+
+		// and a repeated one only until it stops
+		if (f->until != f->start && sim_now > f->until)
+		{
+			queue_head++;
+			stats.missed++;
+			continue;
+		}
+
+		// or at a different rate
+		if (f->rate != rate || (f->code ^ code) & 0x10)
+		{
+			queue_head++;
+			stats.mismatched++;
+			continue;
+		}
+
+		// a repeated frame can still be heard later if this one is lost
+		if (air_lost(air_fade(air_rssi(f->power), rate, code)))
+		{
+			if (f->until != f->start)
+				return 0;
+			queue_head++;
+			continue;
+		}
+
+		queue_head++;
+
+		memset(buf, 0, len);
+		memcpy(buf, f->data, f->len < len ? f->len : len);
+		stats.rx_packets++;
+		stats.rx_bytes += f->len;
+		return 1;
+	}
+
+	return 0;
+}
+
+// a repeated frame for id that a window starting at t would hear
+static const frame_t * air_repeated(uint32_t id, unsigned long long t, unsigned long long active)
+{
+	for(unsigned i = queue_head ; i != queue_tail ; i++)
+	{
+		const frame_t * const f = &queue[i % MAX_FRAMES];
+		if (f->id == id && f->until != f->start
+		&&  t + active >= f->start && t <= f->until)
+			return f;
+	}
+
+	return NULL;
+}
+
+/*
+ * Windows start at first and then every period.  Returns the first one
+ * from after onwards that overlaps a repeated frame for id.
+ */
+unsigned long long air_wake_next(
+	uint32_t id,
+	unsigned long long after,
+	unsigned long long first,
+	unsigned long long period,
+	unsigned long long active
+)
+{
+	unsigned long long next = SIM_NEVER;
+
+	for(unsigned i = queue_head ; i != queue_tail ; i++)
+	{
+		const frame_t * const f = &queue[i % MAX_FRAMES];
+		if (f->id != id || f->until == f->start)
+			continue;
+
+		unsigned long long t = f->start > active ? f->start - active : 0;
+		if (t < after)
+			t = after;
+
+		const unsigned long long w = t <= first ? first
+			: first + (t - first + period - 1) / period * period;
+		if (w <= f->until && w < next)
+			next = w;
+	}
+
+	return next;
+}
+
+// the frame stays queued, so that a lost one can be heard next time
+int air_wake_rx(uint32_t id, uint8_t * buf, uint8_t len, unsigned long long active)
+{
+	const frame_t * const f = air_repeated(id, sim_now, active);
+	if (!f || air_lost(air_fade(air_rssi(f->power), f->rate, f->code)))
+		return 0;
+
+	memset(buf, 0, len);
+	memcpy(buf, f->data, f->len < len ? f->len : len);
+	stats.rx_packets++;
+	stats.rx_bytes += f->len;
+	return 1;
+}
+
+void air_report(FILE * f)
+{
+	fprintf(f, "air_tx_packets %llu\n", (unsigned long long) stats.tx_packets);
+	fprintf(f, "air_tx_bytes %llu\n", (unsigned long long) stats.tx_bytes);
+	fprintf(f, "air_rx_packets %llu\n", (unsigned long long) stats.rx_packets);
+	fprintf(f, "air_rx_bytes %llu\n", (unsigned long long) stats.rx_bytes);
+	fprintf(f, "air_lost %llu\n", (unsigned long long) stats.lost);
+	fprintf(f, "air_missed %llu\n", (unsigned long long) stats.missed);
+	fprintf(f, "air_busy %llu\n", (unsigned long long) stats.busy);
+	fprintf(f, "air_faded %llu\n", (unsigned long long) stats.faded);
+	fprintf(f, "air_mismatched %llu\n", (unsigned long long) stats.mismatched);
+}
@@ -0,0 +1,118 @@
+#!/usr/bin/env python3
+# Energy benchmarks: runs the host simulator through a few scenarios
+# with the gateway and prints what each one costs from the energy_*
+# stats, and how long a CR2450 would last if the tag did it forever.
+#
+#   ./sim/bench.py [scenario...]
+#
+# from src/ after make epd-sim, or make bench.
+import argparse
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+SRC = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+SERVER = os.path.join(SRC, '..', 'server')
+SIM = os.path.join(SRC, 'epd-sim')
+
+# seconds of tag time for each watchdog tick, 32768 VLO ticks at 12 kHz
+TICK = 32768 / 12000
+DAY = 86400
+WEEK = 7 * DAY
+
+PARTS = ['mcu', 'radio', 'flash', 'epd']
+
+def ticks(seconds):
+	return int(seconds / TICK)
+
+def price_labels(tmp, days):
+	# a price change a day as fields of shelf.template
+	template = os.path.abspath(os.path.join(SERVER, 'shelf.template'))
+	labels = []
+	for day in range(days + 1):
+		filename = os.path.join(tmp, 'price%d.label' % (day))
+		with open(filename, 'w') as f:
+			f.write('template %s\n' % (template))
+			f.write('field name Whole Milk\n')
+			f.write('field size 1 gallon, 2% fat\n')
+			f.write('field price 3.%02d\n' % (49 + day))
+			f.write('field unit $0.03/fl oz\n')
+		labels.append(filename)
+	return labels
+
+def run(flash, seconds, images, every=None, args=[]):
+	gateway = 'cd %s && exec python3 -u server.py --sim' % (SERVER)
+	if every is not None:
+		gateway += ' --every %d' % (every)
+	gateway += ' ' + ' '.join(images)
+
+	cmd = [SIM, '-t', str(ticks(seconds)), '-f', flash, '-g', gateway] + args
+	p = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL, universal_newlines=True, check=True)
+
+	stats = {}
+	for line in p.stdout.splitlines():
+		(name, value) = line.split()
+		stats[name] = float(value)
+	return stats
+
+# each scenario sets up the flash in a temporary directory, which the
+# warm up runs are not counted for, and returns the stats of its run
+def idle_week(tmp, flash):
+	run(flash, 600, ['hello.png'])
+	return run(flash, WEEK, ['hello.png'])
+
+def daily_price_push(tmp, flash):
+	labels = price_labels(tmp, 7)
+	run(flash, 600, labels[:1])
+	return run(flash, WEEK, labels, every=DAY)
+
+def full_image_daily(tmp, flash):
+	return run(flash, DAY, ['hello.png'])
+
+def full_image_daily_loss(tmp, flash):
+	return run(flash, DAY, ['hello.png'], args=['-l', '10'])
+
+def idle_week_far(tmp, flash):
+	run(flash, 600, ['hello.png'], args=['-a', '92'])
+	return run(flash, WEEK, ['hello.png'], args=['-a', '92'])
+
+def idle_week_low_battery(tmp, flash):
+	run(flash, 600, ['hello.png'], args=['-v', '2.4'])
+	return run(flash, WEEK, ['hello.png'], args=['-v', '2.4'])
+
+SCENARIOS = [
+	('idle-week', idle_week),
+	('daily-price-push', daily_price_push),
+	('full-image-daily', full_image_daily),
+	('full-image-daily-loss10', full_image_daily_loss),
+	('idle-week-far', idle_week_far),
+	('idle-week-2.4v', idle_week_low_battery),
+]
+
+if __name__ == "__main__":
+	parser = argparse.ArgumentParser(description='Projected battery life of the tag firmware in the simulator')
+	parser.add_argument('scenario', nargs='*', help='Scenarios to run, all of them by default: ' + ', '.join(name for (name, _) in SCENARIOS))
+	args = parser.parse_args()
+
+	scenarios = [(name, f) for (name, f) in SCENARIOS if not args.scenario or name in args.scenario]
+	if not scenarios:
+		sys.exit('no such scenario')
+
+	print('%-24s %6s %8s %8s %8s %8s %8s %8s %7s' % (
+		'scenario', 'days', 'mcu', 'radio', 'flash', 'epd', 'mAh', 'avg uA', 'CR2450'))
+
+	for (name, scenario) in scenarios:
+		tmp = tempfile.mkdtemp()
+		try:
+			stats = scenario(tmp, os.path.join(tmp, 'flash.bin'))
+		finally:
+			shutil.rmtree(tmp)
+
+		print('%-24s %6.1f %s %8.3f %8.1f %6dd' % (
+			name, stats['sim_seconds'] / DAY,
+			' '.join('%8.3f' % (stats['energy_%s_uah' % (part)] / 1000) for part in PARTS),
+			stats['energy_total_uah'] / 1000, stats['energy_avg_ua'],
+			stats['energy_battery_days']))
+		sys.stdout.flush()
@@ -0,0 +1,266 @@
+/*
+ * E-Ink display controller model.
+ *
+ * The panel appears to use a SSD1608/SSD1675 style controller: a
+ * command byte with DC low followed by data bytes with DC high.
+ * Only the commands that the firmware sends are decoded: the RAM
+ * window and address counters, the RAM write, the LUT upload and
+ * the update sequence that holds BUSY high while the panel refreshes.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "sim.h"
+
+#define EPD_DC		0x35
+
+#define RAM_STRIDE	16
+#define RAM_LINES	256
+
+// how long BUSY is high after a software reset and per waveform
+// phase of an update, roughly
+#define RESET_BUSY_MS	2
+#define PHASE_BUSY_MS	200
+
+static uint8_t ram[RAM_LINES][RAM_STRIDE];
+static uint8_t lut[32];
+
+static uint8_t cmd;
+static unsigned data_num;
+static uint8_t data[4];
+
+static uint8_t entry_mode = 0x03;
+static uint8_t x_start, x_end, x;
+static uint16_t y_start, y_end, y;
+
+// sim_now when BUSY falls
+static unsigned long long busy_until;
+static const char * output;
+
+// cycle count when the current RAM write started
+static unsigned long long upload_start;
+
+static struct {
+	uint64_t commands;
+	uint64_t data_bytes;
+	uint64_t ram_bytes;
+	uint64_t lut_uploads;
+	uint64_t refreshes;
+	uint64_t refresh_phases;
+	uint64_t busy_polls;
+	uint64_t busy_ms;
+	uint64_t uploads;
+	uint64_t upload_cycles;
+} stats;
+
+void eink_output(const char * filename)
+{
+	output = filename;
+}
+
+/*
+ * Write the RAM as a PBM, with set bits as white pixels.
+ */
+static void eink_save(void)
+{
+	if (!output)
+		return;
+
+	FILE * const f = fopen(output, "wb");
+	if (!f)
+	{
+		perror(output);
+		return;
+	}
+
+	fprintf(f, "P4\n%d %d\n", RAM_STRIDE * 8, 250);
+	for(unsigned row = 0 ; row < 250 ; row++)
+		for(unsigned col = 0 ; col < RAM_STRIDE ; col++)
+			fputc(ram[row][col] ^ 0xFF, f);
+
+	fclose(f);
+}
+
+/*
+ * The waveform LUT has sixteen bytes of voltage selection followed by
+ * the phase timings; the number of non-zero phases is a good proxy
+ * for how long the panel is driven.
+ */
+static unsigned lut_phases(void)
+{
+	unsigned phases = 0;
+	for(unsigned i = 16 ; i < sizeof(lut) ; i++)
+		phases += lut[i] != 0;
+	return phases;
+}
+
+static void ram_write(const uint8_t value)
+{
+	ram[y % RAM_LINES][x % RAM_STRIDE] = value;
+	stats.ram_bytes++;
+
+	const int x_dir = (entry_mode & 1) ? 1 : -1;
+	const int y_dir = (entry_mode & 2) ? 1 : -1;
+
+	if (entry_mode & 4)
+	{
+		// Y direction first
+		if (y != y_end)
+		{
+			y += y_dir;
+			return;
+		}
+		y = y_start;
+		x = (x == x_end) ? x_start : x + x_dir;
+		return;
+	}
+
+	if (x != x_end)
+	{
+		x += x_dir;
+		return;
+	}
+	x = x_start;
+	y = (y == y_end) ? y_start : y + y_dir;
+}
+
+static void busy_set(const unsigned ms)
+{
+	busy_until = sim_now + (unsigned long long) ms * sim_vlo_hz / 1000;
+	stats.busy_ms += ms;
+}
+
+static void command(const uint8_t value)
+{
+	// the MCU time for a frame is from the RAM write to the next command
+	if (cmd == 0x24)
+		stats.upload_cycles += sim_cycles - upload_start;
+
+	cmd = value;
+	data_num = 0;
+	stats.commands++;
+
+	// a refresh lasts until the next command, after BUSY falls
+	if (cmd == 0x10)
+		energy_set(ENERGY_EPD_SLEEP);
+	else
+	if (cmd == 0x20)
+		energy_set(ENERGY_EPD_REFRESH);
+	else
+		energy_set(ENERGY_EPD_ON);
+
+	switch(cmd)
+	{
+	case 0x12:
+		busy_set(RESET_BUSY_MS);
+		break;
+	case 0x20:
+		stats.refreshes++;
+		stats.refresh_phases += lut_phases();
+		busy_set(lut_phases() * PHASE_BUSY_MS);
+		eink_save();
+		break;
+	case 0x24:
+		stats.uploads++;
+		upload_start = sim_cycles;
+		break;
+	case 0x32:
+		stats.lut_uploads++;
+		memset(lut, 0, sizeof(lut));
+		break;
+	}
+}
+
+static void data_byte(const uint8_t value)
+{
+	const unsigned n = data_num++;
+	stats.data_bytes++;
+
+	if (n < sizeof(data))
+		data[n] = value;
+
+	switch(cmd)
+	{
+	case 0x11:
+		entry_mode = value;
+		break;
+	case 0x24:
+		ram_write(value);
+		break;
+	case 0x32:
+		if (n < sizeof(lut))
+			lut[n] = value;
+		break;
+	case 0x44:
+		if (n == 0)
+			x_start = value;
+		else
+			x_end = value;
+		break;
+	case 0x45:
+		if (n == 1)
+			y_start = data[0] | (data[1] << 8);
+		else
+		if (n == 3)
+			y_end = data[2] | (data[3] << 8);
+		break;
+	case 0x4e:
+		x = value;
+		break;
+	case 0x4f:
+		if (n == 1)
+			y = data[0] | (data[1] << 8);
+		else
+			y = value;
+		break;
+	}
+}
+
+static uint8_t eink_xfer(uint8_t in)
+{
+	if (sim_pin_state(EPD_DC))
+		data_byte(in);
+	else
+		command(in);
+
+	// write only, there is no MISO
+	return 0xFF;
+}
+
+sim_spi_t eink_spi = {
+	.name = "epd",
+	.cs = 0x34,
+	.clk = 0x23,
+	.mosi = 0x24,
+	.xfer = eink_xfer,
+};
+
+void eink_power(int on)
+{
+	energy_set(on ? ENERGY_EPD_ON : ENERGY_EPD_OFF);
+}
+
+uint8_t eink_busy(void)
+{
+	stats.busy_polls++;
+	return sim_now < busy_until;
+}
+
+unsigned long long eink_busy_next(void)
+{
+	return sim_now < busy_until ? busy_until : SIM_NEVER;
+}
+
+void eink_report(FILE * f)
+{
+	fprintf(f, "epd_commands %llu\n", (unsigned long long) stats.commands);
+	fprintf(f, "epd_data_bytes %llu\n", (unsigned long long) stats.data_bytes);
+	fprintf(f, "epd_ram_bytes %llu\n", (unsigned long long) stats.ram_bytes);
+	fprintf(f, "epd_lut_uploads %llu\n", (unsigned long long) stats.lut_uploads);
+	fprintf(f, "epd_refreshes %llu\n", (unsigned long long) stats.refreshes);
+	fprintf(f, "epd_refresh_phases %llu\n", (unsigned long long) stats.refresh_phases);
+	fprintf(f, "epd_busy_polls %llu\n", (unsigned long long) stats.busy_polls);
+	fprintf(f, "epd_busy_ms %llu\n", (unsigned long long) stats.busy_ms);
+	fprintf(f, "epd_uploads %llu\n", (unsigned long long) stats.uploads);
+	fprintf(f, "epd_upload_cycles %llu\n", (unsigned long long) stats.upload_cycles);
+}
@@ -0,0 +1,135 @@
+/*
+ * Energy accounting for the simulated tag.
+ *
+ * Each part is in one state at a time and the models call energy_set()
+ * when it changes, so that the time in each state can be multiplied
+ * by its current.  The time line is sim_time(), which is the
+ * simulated time plus the time that the MCU was awake for, since the
+ * radio, flash and display stay in their states while it works.
+ * Things that the models finish without any time passing, like a
+ * flash erase or a wake on radio listen window, are added on with
+ * energy_add().
+ *
+ * The currents are the typical ones at 3V from the datasheets in
+ * datasheets/, except for the display, which there isn't one for.
+ * The totals are turned into an average current and the days that a
+ * CR2450 would last at it.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include "sim.h"
+
+// nominal capacity of a CR2450 down to 2V
+#define BATTERY_MAH	620
+
+enum {
+	PART_MCU,
+	PART_RADIO,
+	PART_FLASH,
+	PART_EPD,
+	PARTS
+};
+
+static const char * const part_names[PARTS] = {
+	[PART_MCU]	= "mcu",
+	[PART_RADIO]	= "radio",
+	[PART_FLASH]	= "flash",
+	[PART_EPD]	= "epd",
+};
+
+static const struct {
+	const char * name;
+	uint8_t part;
+	double ua;
+} states[ENERGY_STATES] = {
+	// MSP430G2553: 330 uA per MHz active at 3V, LPM0 at 1 MHz and
+	// LPM3 on the VLO are only given at 2.2V
+	[ENERGY_MCU_LPM3]	= { "mcu_lpm3", PART_MCU, 0.5 },
+	[ENERGY_MCU_LPM0]	= { "mcu_lpm0", PART_MCU, 56 },
+	[ENERGY_MCU_1MHZ]	= { "mcu_1mhz", PART_MCU, 330 },
+	[ENERGY_MCU_8MHZ]	= { "mcu_8mhz", PART_MCU, 2640 },
+
+	// A7106, chapter 8.  The low power TX setting is the -10 dBm one
+	// from chapter 19
+	[ENERGY_RADIO_SLEEP]	= { "radio_sleep", PART_RADIO, 1.5 },
+	[ENERGY_RADIO_IDLE]	= { "radio_idle", PART_RADIO, 300 },
+	[ENERGY_RADIO_STBY]	= { "radio_stby", PART_RADIO, 1900 },
+	[ENERGY_RADIO_PLL]	= { "radio_pll", PART_RADIO, 9000 },
+	[ENERGY_RADIO_RX]	= { "radio_rx", PART_RADIO, 16000 },
+	[ENERGY_RADIO_TX]	= { "radio_tx", PART_RADIO, 20000 },
+	[ENERGY_RADIO_TX_LOW]	= { "radio_tx_low", PART_RADIO, 13120 },
+
+	// W25X10CL ICC1, ICC3 between 1 and 33 MHz, ICC5 and ICC6.
+	// the firmware never sends it the power down command.
+	[ENERGY_FLASH_STANDBY]	= { "flash_standby", PART_FLASH, 10 },
+	[ENERGY_FLASH_ACTIVE]	= { "flash_active", PART_FLASH, 2000 },
+	[ENERGY_FLASH_PROGRAM]	= { "flash_program", PART_FLASH, 10000 },
+	[ENERGY_FLASH_ERASE]	= { "flash_erase", PART_FLASH, 10000 },
+
+	// rough figures for a 2.13" panel with an SSD1675 style controller
+	[ENERGY_EPD_OFF]	= { "epd_off", PART_EPD, 0 },
+	[ENERGY_EPD_SLEEP]	= { "epd_sleep", PART_EPD, 1 },
+	[ENERGY_EPD_ON]		= { "epd_on", PART_EPD, 250 },
+	[ENERGY_EPD_REFRESH]	= { "epd_refresh", PART_EPD, 5000 },
+};
+
+// the reset state of each part
+static unsigned current[PARTS] = {
+	[PART_MCU]	= ENERGY_MCU_1MHZ,
+	[PART_RADIO]	= ENERGY_RADIO_SLEEP,
+	[PART_FLASH]	= ENERGY_FLASH_STANDBY,
+	[PART_EPD]	= ENERGY_EPD_OFF,
+};
+
+static double since[PARTS];
+static double seconds[ENERGY_STATES];
+
+// charge the part's state up to now
+static void energy_update(const unsigned part)
+{
+	const double now = sim_time();
+	seconds[current[part]] += now - since[part];
+	since[part] = now;
+}
+
+void energy_set(const unsigned state)
+{
+	const unsigned part = states[state].part;
+	if (current[part] == state)
+		return;
+
+	energy_update(part);
+	current[part] = state;
+}
+
+void energy_add(const unsigned state, const double s)
+{
+	seconds[state] += s;
+}
+
+void energy_report(FILE * f)
+{
+	double part_uah[PARTS] = { 0 };
+	double total_uah = 0;
+
+	for(unsigned i = 0 ; i < PARTS ; i++)
+		energy_update(i);
+
+	for(unsigned i = 0 ; i < ENERGY_STATES ; i++)
+	{
+		const double uah = seconds[i] * states[i].ua / 3600;
+		part_uah[states[i].part] += uah;
+		total_uah += uah;
+
+		fprintf(f, "energy_%s_ms %.1f\n", states[i].name, seconds[i] * 1000);
+		fprintf(f, "energy_%s_uah %.3f\n", states[i].name, uah);
+	}
+
+	for(unsigned i = 0 ; i < PARTS ; i++)
+		fprintf(f, "energy_%s_uah %.3f\n", part_names[i], part_uah[i]);
+
+	const double avg_ua = total_uah * 3600 / sim_time();
+	fprintf(f, "energy_total_uah %.3f\n", total_uah);
+	fprintf(f, "energy_avg_ua %.3f\n", avg_ua);
+	fprintf(f, "energy_battery_days %.0f\n", BATTERY_MAH * 1000.0 / avg_ua / 24);
+}
@@ -0,0 +1,118 @@
+/*
+ * Host stand-in for the msp430g2553 register header.
+ *
+ * The tag firmware is compiled for Linux with -Isim so that this file
+ * is found instead of the real <msp430.h>.  The special function
+ * registers are plain variables, the low power modes hand control to
+ * the simulator, and interrupt handlers become normal functions that
+ * the simulator calls by name.
+ *
+ * GPIO does not go through P1OUT/P2OUT/P3OUT; pins.h routes pin
+ * access into the peripheral models instead, and spi.h does the same
+ * for bytes sent through the USCI.
+ */
+#ifndef _sim_msp430_h_
+#define _sim_msp430_h_
+
+#include <stdint.h>
+
+extern volatile uint8_t P1DIR, P1IN, P1OUT;
+extern volatile uint8_t P2DIR, P2IN, P2OUT;
+extern volatile uint8_t P3DIR, P3IN, P3OUT;
+
+extern volatile uint8_t P1SEL, P1SEL2;
+
+#define BIT0		0x01
+#define BIT1		0x02
+#define BIT2		0x04
+#define BIT3		0x08
+#define BIT4		0x10
+#define BIT5		0x20
+#define BIT6		0x40
+#define BIT7		0x80
+
+/* the USCI data path goes through sim_usci_xfer() in spi.h */
+extern volatile uint8_t UCA0CTL0, UCA0CTL1, UCA0BR0, UCA0BR1, UCA0MCTL;
+extern volatile uint8_t UCB0CTL0, UCB0CTL1, UCB0BR0, UCB0BR1;
+#define UCCKPH		0x80
+#define UCMSB		0x20
+#define UCMST		0x08
+#define UCSYNC		0x01
+#define UCSSEL_2	0x80
+#define UCSWRST		0x01
+
+extern volatile uint8_t P1IE, P1IES, P1IFG;
+extern volatile uint8_t P2IE, P2IES, P2IFG;
+
+/* Timer_A0 is only modelled as a CCR0 interrupt in up mode on ACLK or SMCLK */
+extern volatile uint16_t TA0CTL, TA0CCTL0, TA0CCR0, TA0R;
+#define TASSEL_1	0x0100
+#define TASSEL_2	0x0200
+#define MC_1		0x0010
+#define TACLR		0x0004
+#define CCIE		0x0010
+
+extern volatile uint16_t WDTCTL;
+#define WDTPW		0x5A00
+#define WDTHOLD		0x0080
+#define WDTCNTCL	0x0008
+#define WDT_ADLY_1000	0x5A1C
+
+extern volatile uint8_t IE1;
+#define WDTIE		0x01
+
+extern volatile uint8_t BCSCTL3;
+#define LFXT1S_2	0x20
+
+/* the DCO runs at whatever the calibration constants say */
+extern volatile uint8_t BCSCTL1, DCOCTL;
+#define CALBC1_1MHZ	0x86
+#define CALDCO_1MHZ	0xB5
+#define CALBC1_8MHZ	0x8D
+#define CALDCO_8MHZ	0x8F
+
+extern volatile uint16_t ADC10CTL0;
+extern volatile uint16_t ADC10CTL1;
+// the sim answers for whichever input ADC10CTL1 selects
+uint16_t sim_adc10mem(void);
+#define ADC10MEM sim_adc10mem()
+#define ADC10SC		0x0001
+#define ENC		0x0002
+#define ADC10IFG	0x0004
+#define ADC10ON		0x0010
+#define REFON		0x0020
+#define REF2_5V		0x0040
+#define ADC10SR		0x0400
+#define ADC10SHT_2	0x1000
+#define ADC10SHT_3	0x1800
+#define SREF_1		0x2000
+#define ADC10BUSY	0x0001
+#define ADC10SSEL_0	0x0000
+#define ADC10SSEL_2	0x0010
+#define ADC10DIV_0	0x0000
+#define ADC10DIV_1	0x0020
+#define ADC10DIV_3	0x0060
+#define SHS_0		0x0000
+#define INCH_10		0xA000
+#define INCH_11		0xB000
+
+#define PORT1_VECTOR	4
+#define PORT2_VECTOR	6
+#define TIMER0_A0_VECTOR	18
+#define WDT_VECTOR	20
+
+/* the firmware's ISRs are called directly by the simulator */
+#define interrupt(vector) used
+
+void sim_lpm3(void);
+#define LPM3		sim_lpm3()
+#define LPM3_EXIT	do {} while (0)
+#define LPM3_bits	0x00D0
+#define LPM0_bits	0x0010
+#define GIE		0x0008
+#define __bis_SR_register(bits)	sim_lpm3()
+
+#define __enable_interrupt()	do {} while (0)
+#define __disable_interrupt()	do {} while (0)
+
+#endif
@@ -0,0 +1,146 @@
+#!/usr/bin/env python3
+# Resets the simulated tag part way through a broadcast, while it has
+# coded blocks kept in the sector after the head of the log, and checks
+# that it boots with the image that it was receiving and finishes it.
+#
+#   ./sim/reset.py
+#
+# from src/ after make epd-sim.  It runs itself as the gateway, which
+# is server.py with the second image set once the tag has the first and
+# is listening on its group, so that it is woken for a broadcast.  That
+# gateway exits part way through, and the tag is started again on the
+# same flash with one that only has the second image.
+import argparse
+import os
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+
+SRC = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+SERVER = os.path.join(SRC, '..', 'server')
+SIM = os.path.join(SRC, 'epd-sim')
+
+IMAGES = ['price.label', 'hello.png']
+LOSS = 30
+
+# packets of the broadcast that are sent before the gateway exits, all
+# 77 blocks of the second image and then a few coded ones
+STOP = 90
+
+# the flash_img_t fields and IMG_FORMAT_CODED, see main.c
+SECTOR = 4096
+SLOTS = 32
+FORMAT_CODED = 4
+CODED_SEEDS = 16
+CODED_PENDING = 120
+
+def gateway(log, filenames, stop):
+	sys.path.insert(0, SERVER)
+	os.chdir(SERVER)
+	import server
+
+	s = server.eink_server(sim=True)
+	images = [server.load_image(filename) for filename in filenames]
+	s.set_image(*images.pop(0))
+
+	hello = s.hello
+	def logged(data):
+		(client_id, flags, img_id) = struct.unpack('<4xI10xHI', data[0:24])
+		if img_id in s.images:
+			missing = len(s.missing_blocks(s.stream(img_id, flags)[0], data[24:]))
+		else:
+			missing = -1
+		with open(log, 'a') as f:
+			f.write('%08x %d\n' % (img_id, missing))
+		hello(data)
+		session = s.sessions[client_id]
+		if images and session.state == 'complete' and session.group is not None:
+			s.set_image(*images.pop(0))
+			broadcast()
+	s.hello = logged
+
+	# stop sending once the broadcast is under way
+	def broadcast():
+		transmit = s.radio.transmit
+		sent = [0]
+		def counted(data):
+			transmit(data)
+			sent[0] += 1
+			if stop and sent[0] == stop:
+				sys.stdout.flush()
+				os._exit(0)
+		s.radio.transmit = counted
+
+	s.serve()
+
+def run(flash, ticks, log, images, stop=0):
+	gateway = '%s -u %s --gateway %s --stop %d %s' % (
+	  sys.executable, os.path.abspath(__file__), log, stop, ' '.join(images))
+	cmd = [SIM, '-t', str(ticks), '-f', flash, '-l', str(LOSS), '-g', gateway]
+	subprocess.run(cmd, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL, check=True)
+
+def hellos(log):
+	with open(log) as f:
+		lines = [line.split() for line in f]
+	return [(int(img_id, 16), int(missing)) for (img_id, missing) in lines if img_id != 'broadcast']
+
+def pending(flash):
+	# coded blocks kept in a scratch sector that haven't been used
+	with open(flash, 'rb') as f:
+		data = f.read()
+	count = 0
+	for slot in range(SLOTS):
+		hdr = data[slot * SECTOR : slot * SECTOR + CODED_SEEDS]
+		if len(hdr) < CODED_SEEDS or hdr[7] != FORMAT_CODED:
+			continue
+		seeds = struct.unpack_from('<%dH' % (CODED_PENDING), data, slot * SECTOR + CODED_SEEDS)
+		count += len([seed for seed in seeds if seed not in (0, 0xFFFF)])
+	return count
+
+def image_id(filename):
+	sys.path.insert(0, SERVER)
+	cwd = os.getcwd()
+	os.chdir(SERVER)
+	import server
+	img_id = server.load_image(filename)[1]
+	os.chdir(cwd)
+	return img_id
+
+if __name__ == "__main__":
+	parser = argparse.ArgumentParser(description='Reset the simulated tag while it has coded blocks pending')
+	parser.add_argument('--gateway', help=argparse.SUPPRESS)
+	parser.add_argument('--stop', type=int, default=0, help=argparse.SUPPRESS)
+	parser.add_argument('image', nargs='*', help=argparse.SUPPRESS)
+	args = parser.parse_args()
+
+	if args.gateway:
+		gateway(args.gateway, args.image, args.stop)
+		sys.exit(0)
+
+	target = image_id(IMAGES[-1])
+	tmp = tempfile.mkdtemp()
+	try:
+		flash = os.path.join(tmp, 'flash.bin')
+		log = os.path.join(tmp, 'hellos')
+
+		open(log, 'w').close()
+		run(flash, 1000, log, IMAGES, STOP)
+		if not pending(flash):
+			sys.exit('no coded blocks pending')
+		print('stopped with %d coded blocks pending' % (pending(flash)))
+
+		# the gateway only has the one that it was sending
+		open(log, 'w').close()
+		run(flash, 1000, log, IMAGES[-1:])
+		seen = hellos(log)
+		print('after the reset: %s' % (', '.join('%08x missing %d' % h for h in seen)))
+
+		if seen[0][0] != target or seen[0][1] <= 0:
+			sys.exit('booted with %08x missing %d instead of part of %08x' % (seen[0] + (target,)))
+		if seen[-1] != (target, 0):
+			sys.exit('did not finish %08x' % (target))
+		print('ok')
+	finally:
+		shutil.rmtree(tmp)
@@ -0,0 +1,406 @@
+/*
+ * Host simulator for the eink tag firmware.
+ *
+ * The firmware is compiled unchanged except for the pin layer in
+ * pins.h, which calls into this file.  Pin writes are decoded into
+ * SPI transactions for the A7106 radio, the W25X10 flash and the
+ * display controller, and the bit-banged traffic, flash program and
+ * erase cycles and display refreshes are counted so that every
+ * firmware or protocol change can be compared run against run.
+ *
+ * Usage: ./epd-sim [-t ticks] [-f flash.bin] [-o panel.pbm]
+ *		[-v volts] [-T celsius] [-l loss%] [-s seed] [-k vlo-hz]
+ *		[-b busy%] [-a atten-db] [-g 'gateway command']
+ *
+ * -k sets how fast the VLO really runs, which the firmware assumes is
+ * 12 kHz, for the check in schedule.  -b is how often the channel is
+ * in use when the tag listens before it talks.  -a is the path loss
+ * to the gateway, 60 dB is close by and from about 90 dB only the
+ * slower rates get through.  -v and -T are what the ADC reads for
+ * the battery and the temperature sensor, which decide when the radio
+ * is calibrated again.
+ */
+#define _DEFAULT_SOURCE
+#include <msp430.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "sim.h"
+#include "../spi.h"
+
+volatile uint8_t P1DIR, P1IN, P1OUT;
+volatile uint8_t P2DIR, P2IN, P2OUT;
+volatile uint8_t P3DIR, P3IN, P3OUT;
+volatile uint8_t P1SEL, P1SEL2;
+volatile uint8_t UCA0CTL0, UCA0CTL1, UCA0BR0, UCA0BR1, UCA0MCTL;
+volatile uint8_t UCB0CTL0, UCB0CTL1, UCB0BR0, UCB0BR1;
+volatile uint8_t P1IE, P1IES, P1IFG;
+volatile uint8_t P2IE, P2IES, P2IFG;
+volatile uint16_t TA0CTL, TA0CCTL0, TA0CCR0, TA0R;
+volatile uint16_t WDTCTL;
+volatile uint8_t IE1;
+volatile uint8_t BCSCTL3;
+volatile uint8_t BCSCTL1 = 0x87, DCOCTL = 0x60; // about 1.1 MHz at reset
+volatile uint16_t ADC10CTL0;
+volatile uint16_t ADC10CTL1;
+
+// Vcc/2 against the 2.5V reference, and the temperature sensor
+// against the 1.5V one
+static uint16_t sim_adc_vcc;
+static uint16_t sim_adc_temp;
+
+uint16_t sim_adc10mem(void)
+{
+	if ((ADC10CTL1 & 0xF000) == INCH_10)
+		return sim_adc_temp;
+	return sim_adc_vcc;
+}
+
+// provided by the firmware
+int tag_main(void);
+void watchdog_timer(void);
+void radio_wtr_interrupt(void);
+void timer_interrupt(void);
+void epd_busy_interrupt(void);
+
+static uint8_t pin_out[4];
+static uint8_t pin_dir[4];
+
+static sim_spi_t * const buses[] = {
+	&a7106_spi,
+	&w25x10_spi,
+	&eink_spi,
+};
+
+/*
+ * Rough MCLK cycles for each I/O operation, so that the drivers can be
+ * compared: a bis/bic/bit on a port register plus the loop around it,
+ * and eight SPI clocks at SMCLK/1 plus loading TXBUF and polling RXIFG.
+ */
+#define PIN_CYCLES	5
+#define USCI_CYCLES	14
+
+unsigned long long sim_cycles;
+
+// and how long they took at the DCO speed of the time
+static double io_seconds;
+
+static double mcu_hz(void)
+{
+	if (BCSCTL1 == CALBC1_8MHZ && DCOCTL == CALDCO_8MHZ)
+		return 8e6;
+	if (BCSCTL1 == CALBC1_1MHZ && DCOCTL == CALDCO_1MHZ)
+		return 1e6;
+	return 1.1e6;
+}
+
+// and spinning on a device that the model doesn't wait for
+static double busy_seconds;
+
+double sim_time(void)
+{
+	return (double) sim_now / sim_vlo_hz + io_seconds + busy_seconds;
+}
+
+// the MCU is awake at whatever the DCO is set to
+static void mcu_awake(void)
+{
+	energy_set(mcu_hz() == 8e6 ? ENERGY_MCU_8MHZ : ENERGY_MCU_1MHZ);
+}
+
+static void io_cycles(const unsigned cycles)
+{
+	mcu_awake();
+	sim_cycles += cycles;
+	io_seconds += cycles / mcu_hz();
+}
+
+void sim_busy_wait(const double seconds)
+{
+	mcu_awake();
+	busy_seconds += seconds;
+}
+
+#define RADIO_IO1	0x11
+#define RADIO_IO2	0x10
+#define FLASH_DO	0x16
+#define EPD_BUSY	0x25
+#define EPD_POWER	0x31
+
+// VLO ticks per watchdog interval with WDT_ADLY_1000 on the VLO
+#define WDT_INTERVAL	32768
+
+unsigned long long sim_now;
+unsigned sim_vlo_hz = SIM_VLO_HZ;
+static unsigned long long wdt_next = WDT_INTERVAL;
+static unsigned long long timer_start;
+
+static unsigned long ticks;
+static unsigned long max_ticks = 512;
+static const char * flash_file;
+static const char * panel_file;
+
+int sim_pin_state(uint8_t port)
+{
+	return (pin_out[(port >> 4) & 0x3] >> (port & 0x7)) & 1;
+}
+
+void sim_pin_ddr(uint8_t port, int value)
+{
+	const uint8_t mask = 1 << (port & 0x7);
+	if (value)
+		pin_dir[(port >> 4) & 0x3] |= mask;
+	else
+		pin_dir[(port >> 4) & 0x3] &= ~mask;
+}
+
+static void spi_edge(sim_spi_t * const spi, uint8_t port, int value)
+{
+	if (port == spi->cs)
+	{
+		// all of the chip selects are active low
+		spi->selected = !value;
+		spi->bit = 0;
+		spi->in = 0;
+		spi->out = 0xFF;
+		if (spi->select)
+			spi->select(spi->selected);
+		return;
+	}
+
+	if (port != spi->clk || !value)
+		return;
+
+	spi->edges++;
+	if (!spi->selected)
+		return;
+
+	// present the outgoing bit before the firmware samples MISO
+	spi->miso = (spi->out >> (7 - spi->bit)) & 1;
+	spi->in = (spi->in << 1) | sim_pin_state(spi->mosi);
+
+	if (++spi->bit != 8)
+		return;
+
+	spi->bit = 0;
+	spi->bytes++;
+	spi->out = spi->xfer(spi->in);
+}
+
+void sim_pin_write(uint8_t port, int value)
+{
+	io_cycles(PIN_CYCLES);
+
+	const uint8_t mask = 1 << (port & 0x7);
+	uint8_t * const out = &pin_out[(port >> 4) & 0x3];
+	const int old = (*out & mask) != 0;
+
+	value = value != 0;
+	if (value)
+		*out |= mask;
+	else
+		*out &= ~mask;
+
+	if (old == value)
+		return;
+
+	// the display's power switch is a transistor that is on when low
+	if (port == EPD_POWER)
+		eink_power(!value);
+
+	for(unsigned i = 0 ; i < sizeof(buses)/sizeof(*buses) ; i++)
+		spi_edge(buses[i], port, value);
+}
+
+uint8_t sim_pin_read(uint8_t port)
+{
+	io_cycles(PIN_CYCLES);
+
+	switch(port)
+	{
+	case RADIO_IO1: return a7106_spi.miso;
+	case RADIO_IO2: return a7106_gio2();
+	case FLASH_DO: return w25x10_spi.miso;
+	case EPD_BUSY: return eink_busy();
+	default: return sim_pin_state(port);
+	}
+}
+
+/*
+ * A whole byte through one of the USCI modules, see spi.h.
+ * What the device shifts out is what it queued after the last byte.
+ */
+uint8_t sim_usci_xfer(uint8_t bus, uint8_t out)
+{
+	sim_spi_t * const spi = bus == SPI_RADIO ? &a7106_spi : &w25x10_spi;
+	io_cycles(USCI_CYCLES);
+
+	// the module clocks the byte out whether or not anything is
+	// selected, and spi_edge() counts the rising edges, so eight
+	spi->edges += 8;
+	if (!spi->selected)
+		return 0xFF;
+
+	const uint8_t in = spi->out;
+	spi->bytes++;
+	spi->out = spi->xfer(out);
+	return in;
+}
+
+static void report(void)
+{
+	FILE * const f = stdout;
+
+	fprintf(f, "wdt_ticks %lu\n", ticks);
+	fprintf(f, "sim_seconds %.3f\n", (double) sim_now / sim_vlo_hz);
+	fprintf(f, "mcu_io_cycles %llu\n", sim_cycles);
+	fprintf(f, "mcu_io_ms %.1f\n", io_seconds * 1000);
+	for(unsigned i = 0 ; i < sizeof(buses)/sizeof(*buses) ; i++)
+		fprintf(f, "%s_spi_edges %llu\n%s_spi_bytes %llu\n",
+			buses[i]->name, (unsigned long long) buses[i]->edges,
+			buses[i]->name, (unsigned long long) buses[i]->bytes);
+
+	a7106_report(f);
+	air_report(f);
+	w25x10_report(f);
+	eink_report(f);
+	energy_report(f);
+
+	if (flash_file)
+		w25x10_save(flash_file);
+}
+
+/*
+ * Sleep until the next interrupt: the watchdog interval, the Timer_A
+ * CCR0 compare, GIO2 changing, which is WTR falling at the end of a
+ * radio packet or WAK rising for a wake on radio packet, or the
+ * display's BUSY falling.  Time only moves forward here, and the run
+ * ends after max_ticks watchdog ticks.  LPM0 for the SMCLK timer is
+ * the same as LPM3 here.
+ */
+void sim_lpm3(void)
+{
+	// TACLR restarts Timer_A and then clears itself
+	if (TA0CTL & TACLR)
+	{
+		TA0CTL &= ~TACLR;
+		timer_start = sim_now;
+	}
+
+	// and WDTCNTCL restarts the watchdog interval
+	if (WDTCTL & WDTCNTCL)
+	{
+		WDTCTL &= ~WDTCNTCL;
+		wdt_next = sim_now + WDT_INTERVAL;
+	}
+
+	// SMCLK is the DCO, and is rounded up to whole VLO ticks.
+	// it has to keep running in LPM0 for the timer.
+	unsigned long long timer_ticks = TA0CCR0;
+	if (TA0CTL & TASSEL_2)
+		timer_ticks = timer_ticks * sim_vlo_hz / mcu_hz() + 1;
+	energy_set(TA0CTL & TASSEL_2 ? ENERGY_MCU_LPM0 : ENERGY_MCU_LPM3);
+
+	const unsigned long long wdt = (IE1 & WDTIE) ? wdt_next : SIM_NEVER;
+	// up mode to a CCR0 of 0 halts the timer, so it never fires
+	const unsigned long long timer = (TA0CTL & MC_1) && (TA0CCTL0 & CCIE) && TA0CCR0 != 0
+		? timer_start + timer_ticks : SIM_NEVER;
+	const unsigned long long radio = a7106_gio2_next();
+	const unsigned long long epd = (P2IE & BIT5) ? eink_busy_next() : SIM_NEVER;
+
+	if (wdt <= timer && wdt <= radio && wdt <= epd)
+	{
+		if (wdt == SIM_NEVER)
+		{
+			fprintf(stderr, "sim: sleeping with no interrupts enabled\n");
+			report();
+			exit(EXIT_FAILURE);
+		}
+
+		if (ticks == max_ticks)
+		{
+			report();
+			exit(EXIT_SUCCESS);
+		}
+
+		sim_now = wdt;
+		wdt_next += WDT_INTERVAL;
+		ticks++;
+		watchdog_timer();
+		return;
+	}
+
+	if (timer <= radio && timer <= epd)
+	{
+		// up mode counts from 0 to CCR0 and starts over
+		sim_now = timer;
+		timer_start = timer + 1;
+		timer_interrupt();
+		return;
+	}
+
+	if (epd < radio)
+	{
+		// BUSY falling, which is all that P2IES is set up for
+		sim_now = epd;
+		P2IFG |= BIT5;
+		epd_busy_interrupt();
+		return;
+	}
+
+	// P1IES selects the falling edge
+	sim_now = radio;
+	if (a7106_gio2() == !(P1IES & BIT0))
+		P1IFG |= BIT0;
+	if (P1IE & P1IFG & BIT0)
+		radio_wtr_interrupt();
+}
+
+int main(int argc, char ** argv)
+{
+	const char * gateway = NULL;
+	unsigned loss = 0;
+	unsigned seed = 1;
+	double volts = 3.0;
+	double celsius = 25.0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:f:o:v:T:l:s:k:b:a:g:")) != -1)
+	{
+		switch(opt)
+		{
+		case 't': max_ticks = strtoul(optarg, NULL, 0); break;
+		case 'f': flash_file = optarg; break;
+		case 'o': panel_file = optarg; break;
+		case 'v': volts = atof(optarg); break;
+		case 'T': celsius = atof(optarg); break;
+		case 'l': loss = strtoul(optarg, NULL, 0); break;
+		case 's': seed = strtoul(optarg, NULL, 0); break;
+		case 'k': sim_vlo_hz = strtoul(optarg, NULL, 0); break;
+		case 'b': air_busy_set(strtoul(optarg, NULL, 0)); break;
+		case 'a': air_atten(strtoul(optarg, NULL, 0)); break;
+		case 'g': gateway = optarg; break;
+		default:
+			fprintf(stderr, "usage: %s [-t ticks] [-f flash.bin] [-o panel.pbm] [-v volts] [-T celsius] [-l loss%%] [-s seed] [-k vlo-hz] [-b busy%%] [-a atten-db] [-g gateway-cmd]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	// the sensor is 3.55 mV per degree C, 986 mV at 0 C
+	sim_adc_vcc = volts * 1024 / 5.0;
+	sim_adc_temp = (0.986 + celsius * 0.00355) * 1024 / 1.5;
+
+	w25x10_load(flash_file);
+	if (panel_file)
+		eink_output(panel_file);
+
+	air_loss(loss, seed);
+	if (gateway)
+		air_start(gateway);
+
+	tag_main();
+
+	// the firmware never returns
+	return EXIT_FAILURE;
+}
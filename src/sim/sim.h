@@ -0,0 +1,125 @@
+#ifndef _sim_sim_h_
+#define _sim_sim_h_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Generic bit level SPI slave that watches a chip select, clock and
+ * MOSI pin and hands complete bytes to the device model.  The value
+ * returned by the device is shifted out on MISO during the next byte,
+ * so responses can only depend on the bytes already sent, which is
+ * true for the radio, the flash and the display.
+ *
+ * Buses driven by the USCI skip the pins and hand over whole bytes
+ * with sim_usci_xfer().
+ */
+typedef struct sim_spi sim_spi_t;
+
+struct sim_spi {
+	const char * name;
+	uint8_t cs;
+	uint8_t clk;
+	uint8_t mosi;
+
+	void (*select)(int selected);
+	uint8_t (*xfer)(uint8_t in);
+
+	int selected;
+	uint8_t bit;
+	uint8_t in;
+	uint8_t out;
+	uint8_t miso;
+
+	uint64_t edges;
+	uint64_t bytes;
+};
+
+// pin state shared with the models
+int sim_pin_state(uint8_t port);
+
+// estimated MCU cycles spent on I/O so far
+extern unsigned long long sim_cycles;
+
+// simulated time plus the time that the MCU has been awake, and the
+// MCU spinning on a device for that long
+double sim_time(void);
+void sim_busy_wait(double seconds);
+
+// time in VLO ticks, only advanced while the MCU is in a low power mode.
+// the firmware assumes SIM_VLO_HZ, and sim_vlo_hz is what it really is.
+#define SIM_VLO_HZ	12000
+extern unsigned sim_vlo_hz;
+#define SIM_NEVER	(~0ULL)
+extern unsigned long long sim_now;
+
+// the three peripherals on the tag
+extern sim_spi_t a7106_spi;
+extern sim_spi_t w25x10_spi;
+extern sim_spi_t eink_spi;
+
+// GIO2 is WTR or WAK, next is when it will change
+uint8_t a7106_gio2(void);
+unsigned long long a7106_gio2_next(void);
+void a7106_report(FILE * f);
+
+void w25x10_load(const char * filename);
+void w25x10_save(const char * filename);
+void w25x10_report(FILE * f);
+
+// BUSY, and when it will fall
+uint8_t eink_busy(void);
+unsigned long long eink_busy_next(void);
+void eink_output(const char * filename);
+void eink_report(FILE * f);
+// the display's power switch
+void eink_power(int on);
+
+/*
+ * The state that each part is in for the energy accounting, see
+ * energy.c.  energy_add() charges for time that isn't simulated.
+ */
+enum {
+	ENERGY_MCU_LPM3,
+	ENERGY_MCU_LPM0,
+	ENERGY_MCU_1MHZ,
+	ENERGY_MCU_8MHZ,
+	ENERGY_RADIO_SLEEP,
+	ENERGY_RADIO_IDLE,
+	ENERGY_RADIO_STBY,
+	ENERGY_RADIO_PLL,
+	ENERGY_RADIO_RX,
+	ENERGY_RADIO_TX,
+	ENERGY_RADIO_TX_LOW,
+	ENERGY_FLASH_STANDBY,
+	ENERGY_FLASH_ACTIVE,
+	ENERGY_FLASH_PROGRAM,
+	ENERGY_FLASH_ERASE,
+	ENERGY_EPD_OFF,
+	ENERGY_EPD_SLEEP,
+	ENERGY_EPD_ON,
+	ENERGY_EPD_REFRESH,
+	ENERGY_STATES
+};
+
+void energy_set(unsigned state);
+void energy_add(unsigned state, double seconds);
+void energy_report(FILE * f);
+
+// over the air link to the gateway process
+void air_start(const char * cmd);
+void air_loss(unsigned percent, unsigned seed);
+void air_busy_set(unsigned percent);
+void air_atten(unsigned db);
+int air_busy(void);
+// dBm for a TX power register value
+int air_power(uint8_t reg);
+// with the tag's data rate, code and TX power registers
+void air_tx(uint32_t id, const uint8_t * buf, uint8_t len, uint8_t rate, uint8_t code, uint8_t power);
+int air_rx(uint32_t id, uint8_t * buf, uint8_t len, uint8_t rate, uint8_t code);
+unsigned long long air_wake_next(uint32_t id, unsigned long long after,
+	unsigned long long first, unsigned long long period, unsigned long long active);
+int air_wake_rx(uint32_t id, uint8_t * buf, uint8_t len, unsigned long long active);
+void air_report(FILE * f);
+
+#endif
@@ -0,0 +1,248 @@
+/*
+ * Winbond W25X10 SPI flash model.
+ *
+ * 128 KB, 256 byte pages, 4 KB sectors.  Implements the subset of the
+ * command set that the firmware uses: 0x02 page program, 0x03 read,
+ * 0x05 read status, 0x06 write enable and 0x20 sector erase, plus
+ * 0x04 write disable and 0x9F JEDEC ID.  Programming can only clear
+ * bits and wraps within the page, like the real part.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "sim.h"
+
+#define FLASH_SIZE	(128 * 1024)
+#define PAGE_SIZE	256
+#define SECTOR_SIZE	4096
+
+#define SR_WIP		0x01
+#define SR_WEL		0x02
+
+// status polls that report busy after a program or erase
+#define PROGRAM_BUSY	2
+#define ERASE_BUSY	20
+
+// and how long they really take, tPP and tSE typical
+#define PROGRAM_SECONDS	0.0004
+#define ERASE_SECONDS	0.030
+
+static uint8_t mem[FLASH_SIZE];
+static uint16_t sector_erases[FLASH_SIZE / SECTOR_SIZE];
+
+static uint8_t status;
+static unsigned busy;
+
+// the time that each of those polls stands for
+static double busy_poll_seconds;
+
+static uint8_t cmd;
+static unsigned byte_num;
+static uint32_t addr;
+
+static uint8_t page[PAGE_SIZE];
+static unsigned page_len;
+
+static struct {
+	uint64_t reads;
+	uint64_t read_bytes;
+	uint64_t programs;
+	uint64_t program_bytes;
+	uint64_t erases;
+	uint64_t rejected;
+	uint64_t status_polls;
+} stats;
+
+void w25x10_load(const char * filename)
+{
+	memset(mem, 0xFF, sizeof(mem));
+	if (!filename)
+		return;
+
+	FILE * const f = fopen(filename, "rb");
+	if (!f)
+		return;
+
+	if (fread(mem, 1, sizeof(mem), f) != sizeof(mem))
+		fprintf(stderr, "%s: short flash image\n", filename);
+	fclose(f);
+}
+
+void w25x10_save(const char * filename)
+{
+	FILE * const f = fopen(filename, "wb");
+	if (!f)
+	{
+		perror(filename);
+		return;
+	}
+
+	fwrite(mem, 1, sizeof(mem), f);
+	fclose(f);
+}
+
+static int write_enabled(void)
+{
+	if (busy == 0 && (status & SR_WEL))
+		return 1;
+
+	stats.rejected++;
+	return 0;
+}
+
+static void program(void)
+{
+	if (!write_enabled())
+		return;
+
+	const uint32_t base = addr & ~(PAGE_SIZE - 1);
+	for(unsigned i = 0 ; i < page_len ; i++)
+	{
+		const uint32_t a = base + ((addr + i) & (PAGE_SIZE - 1));
+		mem[a % FLASH_SIZE] &= page[i];
+	}
+
+	stats.programs++;
+	stats.program_bytes += page_len;
+	status &= ~SR_WEL;
+	busy = PROGRAM_BUSY;
+	busy_poll_seconds = PROGRAM_SECONDS / PROGRAM_BUSY;
+	energy_add(ENERGY_FLASH_PROGRAM, PROGRAM_SECONDS);
+}
+
+static void erase(void)
+{
+	if (!write_enabled())
+		return;
+
+	const uint32_t base = (addr % FLASH_SIZE) & ~(SECTOR_SIZE - 1);
+	memset(&mem[base], 0xFF, SECTOR_SIZE);
+
+	stats.erases++;
+	sector_erases[base / SECTOR_SIZE]++;
+	status &= ~SR_WEL;
+	busy = ERASE_BUSY;
+	busy_poll_seconds = ERASE_SECONDS / ERASE_BUSY;
+	energy_add(ENERGY_FLASH_ERASE, ERASE_SECONDS);
+}
+
+static void w25x10_select(int selected)
+{
+	energy_set(selected ? ENERGY_FLASH_ACTIVE : ENERGY_FLASH_STANDBY);
+
+	if (selected)
+	{
+		byte_num = 0;
+		page_len = 0;
+		return;
+	}
+
+	// program and erase start when chip select goes high
+	if (cmd == 0x02 && byte_num > 4)
+		program();
+	else
+	if (cmd == 0x20 && byte_num == 4)
+		erase();
+
+	cmd = 0;
+}
+
+static uint8_t w25x10_xfer(uint8_t in)
+{
+	const unsigned n = byte_num++;
+
+	if (cmd == 0x03 && n >= 4)
+		stats.read_bytes++;
+
+	if (n == 0)
+	{
+		cmd = in;
+		addr = 0;
+
+		switch(cmd)
+		{
+		case 0x05:
+			stats.status_polls++;
+			// the firmware spins in flash_wait() until it's done
+			if (busy)
+			{
+				sim_busy_wait(busy_poll_seconds);
+				busy--;
+			}
+			return status | (busy ? SR_WIP : 0);
+		case 0x06:
+			if (!busy)
+				status |= SR_WEL;
+			break;
+		case 0x04:
+			status &= ~SR_WEL;
+			break;
+		case 0x03:
+			// ignored while a program or erase is running
+			if (busy)
+			{
+				stats.rejected++;
+				cmd = 0;
+				break;
+			}
+			stats.reads++;
+			break;
+		case 0x9F:
+			return 0xEF;
+		}
+
+		return 0xFF;
+	}
+
+	switch(cmd)
+	{
+	case 0x05:
+		return status | (busy ? SR_WIP : 0);
+	case 0x9F:
+		return n == 1 ? 0x30 : 0x11;
+	}
+
+	if (n < 4)
+	{
+		addr = (addr << 8) | in;
+		if (n != 3 || cmd != 0x03)
+			return 0xFF;
+
+		// first data byte of a read goes out next
+		return mem[addr++ % FLASH_SIZE];
+	}
+
+	if (cmd == 0x03)
+		return mem[addr++ % FLASH_SIZE];
+
+	if (cmd == 0x02)
+		page[page_len++ % PAGE_SIZE] = in;
+
+	return 0xFF;
+}
+
+sim_spi_t w25x10_spi = {
+	.name = "flash",
+	.cs = 0x30,
+	.clk = 0x15,
+	.mosi = 0x17,
+	.select = w25x10_select,
+	.xfer = w25x10_xfer,
+};
+
+void w25x10_report(FILE * f)
+{
+	unsigned max_erases = 0;
+	for(unsigned i = 0 ; i < FLASH_SIZE / SECTOR_SIZE ; i++)
+		if (sector_erases[i] > max_erases)
+			max_erases = sector_erases[i];
+
+	fprintf(f, "flash_reads %llu\n", (unsigned long long) stats.reads);
+	fprintf(f, "flash_read_bytes %llu\n", (unsigned long long) stats.read_bytes);
+	fprintf(f, "flash_programs %llu\n", (unsigned long long) stats.programs);
+	fprintf(f, "flash_program_bytes %llu\n", (unsigned long long) stats.program_bytes);
+	fprintf(f, "flash_erases %llu\n", (unsigned long long) stats.erases);
+	fprintf(f, "flash_max_sector_erases %u\n", max_erases);
+	fprintf(f, "flash_rejected %llu\n", (unsigned long long) stats.rejected);
+	fprintf(f, "flash_status_polls %llu\n", (unsigned long long) stats.status_polls);
+}
@@ -0,0 +1,136 @@
+#ifndef _epd_spi_h_
+#define _epd_spi_h_
+
+/*
+ * SPI buses for the radio and the flash.
+ *
+ * Both happen to be wired to the USCI pins on port 1, so by default
+ * the bytes go through the hardware shift registers instead of one
+ * pin_write() per edge.  Building with -DSPI_BITBANG uses spi_write()
+ * on the same pins instead.  The EPD is on port 2, which has no USCI,
+ * so it is always bit-banged.
+ *
+ * The chip selects are still GPIO and are handled by the drivers.
+ */
+#include <msp430.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "pins.h"
+
+#define SPI_RADIO	0 // USCI_A0
+#define SPI_FLASH	1 // USCI_B0
+
+// UCA0CLK, UCA0SIMO to SDIO and UCA0SOMI from GIO1
+#define SPI_RADIO_CLK	0x14
+#define SPI_RADIO_SIMO	0x12
+#define SPI_RADIO_SOMI	0x11
+
+// UCB0CLK, UCB0SIMO to DI and UCB0SOMI from DO
+#define SPI_FLASH_CLK	0x15
+#define SPI_FLASH_SIMO	0x17
+#define SPI_FLASH_SOMI	0x16
+
+#ifdef SIM
+uint8_t sim_usci_xfer(uint8_t bus, uint8_t out);
+#endif
+
+static inline void spi_init(const uint8_t bus)
+{
+#ifdef SPI_BITBANG
+	pin_ddr(bus == SPI_RADIO ? SPI_RADIO_CLK : SPI_FLASH_CLK, 1);
+	pin_ddr(bus == SPI_RADIO ? SPI_RADIO_SIMO : SPI_FLASH_SIMO, 1);
+	pin_ddr(bus == SPI_RADIO ? SPI_RADIO_SOMI : SPI_FLASH_SOMI, 0);
+#else
+	// mode 0 master: data is captured on the rising edge of SMCLK/1
+	if (bus == SPI_RADIO)
+	{
+		UCA0CTL1 = UCSWRST;
+		UCA0CTL0 = UCCKPH | UCMSB | UCMST | UCSYNC;
+		UCA0CTL1 = UCSSEL_2 | UCSWRST;
+		UCA0BR0 = 1;
+		UCA0BR1 = 0;
+		UCA0MCTL = 0;
+		P1SEL |= BIT1 | BIT2 | BIT4;
+		P1SEL2 |= BIT1 | BIT2 | BIT4;
+		UCA0CTL1 &= ~UCSWRST;
+	} else {
+		UCB0CTL1 = UCSWRST;
+		UCB0CTL0 = UCCKPH | UCMSB | UCMST | UCSYNC;
+		UCB0CTL1 = UCSSEL_2 | UCSWRST;
+		UCB0BR0 = 1;
+		UCB0BR1 = 0;
+		P1SEL |= BIT5 | BIT6 | BIT7;
+		P1SEL2 |= BIT5 | BIT6 | BIT7;
+		UCB0CTL1 &= ~UCSWRST;
+	}
+#endif
+}
+
+/*
+ * Send one byte and return the one that was clocked in at the same time.
+ * Should be called with a compile time constant for the bus.
+ */
+static inline uint8_t spi_xfer(const uint8_t bus, const uint8_t out)
+{
+#if defined(SPI_BITBANG)
+	if (bus == SPI_RADIO)
+		return spi_write(SPI_RADIO_CLK, SPI_RADIO_SIMO, SPI_RADIO_SOMI, out);
+	else
+		return spi_write(SPI_FLASH_CLK, SPI_FLASH_SIMO, SPI_FLASH_SOMI, out);
+#elif defined(SIM)
+	return sim_usci_xfer(bus, out);
+#else
+	// the receive flag is set once all eight bits have been shifted
+	if (bus == SPI_RADIO)
+	{
+		UCA0TXBUF = out;
+		while (!(IFG2 & UCA0RXIFG))
+			;
+		return UCA0RXBUF;
+	} else {
+		UCB0TXBUF = out;
+		while (!(IFG2 & UCB0RXIFG))
+			;
+		return UCB0RXBUF;
+	}
+#endif
+}
+
+/*
+ * Stream len bytes out of the out buffer and into the in buffer.
+ * If out is NULL zeros are sent, if in is NULL the input is ignored.
+ */
+static inline void spi_xfer_buf(
+	const uint8_t bus,
+	const uint8_t * out,
+	uint8_t * in,
+	uint16_t len
+)
+{
+#ifdef SPI_BITBANG
+	// don't drive or sample the data pins that are not used
+	const uint8_t clk = bus == SPI_RADIO ? SPI_RADIO_CLK : SPI_FLASH_CLK;
+	const uint8_t simo = bus == SPI_RADIO ? SPI_RADIO_SIMO : SPI_FLASH_SIMO;
+	const uint8_t somi = bus == SPI_RADIO ? SPI_RADIO_SOMI : SPI_FLASH_SOMI;
+
+	if (!in)
+		while (len--)
+			spi_write(clk, simo, 0, *out++);
+	else
+	if (!out)
+		while (len--)
+			*in++ = spi_write(clk, 0, somi, 0);
+	else
+		while (len--)
+			*in++ = spi_write(clk, simo, somi, *out++);
+#else
+	while (len--)
+	{
+		const uint8_t value = spi_xfer(bus, out ? *out++ : 0);
+		if (in)
+			*in++ = value;
+	}
+#endif
+}
+
+#endif
@@ -0,0 +1,88 @@
+/*
+ * Timer_A0 delays, see timer.h.
+ *
+ * The interrupt stops the timer and wakes the MCU, and the callers
+ * go back to sleep until their own flag or the timeout is set, since
+ * the watchdog and the radio wake it up as well.
+ */
+#include <msp430.h>
+#include <stdint.h>
+#include "timer.h"
+
+static volatile uint8_t timer_done;
+
+void timer_init(void)
+{
+	BCSCTL3 = LFXT1S_2; // select VLO as the ACLK (used by the WDT and the timer)
+}
+
+void __attribute__((interrupt(TIMER0_A0_VECTOR)))
+timer_interrupt(void)
+{
+	TA0CTL = 0;
+	timer_done = 1;
+	LPM3_EXIT;
+}
+
+static void timer_start(const uint16_t ticks, const uint16_t clock)
+{
+	timer_done = 0;
+	TA0CCR0 = ticks;
+	TA0CCTL0 = CCIE;
+	TA0CTL = clock | MC_1 | TACLR;
+}
+
+static void timer_stop(void)
+{
+	TA0CTL = 0;
+	TA0CCTL0 = 0;
+}
+
+uint8_t timer_wait(volatile uint8_t * const flag, const uint16_t ms)
+{
+	// a CCR0 of 0 halts the timer in up mode, so it would never wake
+	if (ms == 0)
+		return *flag;
+
+	timer_start(ms * (TIMER_VLO_HZ / 1000), TASSEL_1);
+
+	// interrupts are only enabled again as the MCU goes to sleep,
+	// so one that arrives after the check can not be missed
+	const uint8_t fast = clock_sleep();
+	__disable_interrupt();
+	while (!*flag && !timer_done)
+	{
+		__bis_SR_register(LPM3_bits | GIE);
+		__disable_interrupt();
+	}
+	__enable_interrupt();
+	clock_wake(fast);
+
+	timer_stop();
+	return *flag;
+}
+
+void timer_sleep_ms(const uint16_t ms)
+{
+	timer_wait(&timer_done, ms);
+}
+
+void timer_sleep_us(const uint16_t us)
+{
+	if (us == 0)
+		return;
+
+	const uint8_t fast = clock_sleep();
+	timer_start(us * (TIMER_SMCLK_HZ / 1000000), TASSEL_2);
+
+	__disable_interrupt();
+	while (!timer_done)
+	{
+		__bis_SR_register(LPM0_bits | GIE);
+		__disable_interrupt();
+	}
+	__enable_interrupt();
+
+	timer_stop();
+	clock_wake(fast);
+}
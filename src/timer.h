@@ -0,0 +1,26 @@
+#ifndef _epd_timer_h_
+#define _epd_timer_h_
+
+#include <stdint.h>
+#include "clock.h"
+
+/*
+ * One shot delays on Timer_A0 that sleep instead of spinning.  The
+ * millisecond ones count ACLK, which is the VLO, in LPM3, so they are
+ * only as accurate as the VLO and at most 5 s.  The microsecond ones
+ * count SMCLK in LPM0, since LPM3 stops it, at the slow clock.
+ */
+#define TIMER_VLO_HZ 12000
+#define TIMER_SMCLK_HZ CLOCK_SLOW_HZ
+
+// selects the VLO as ACLK, before anything sleeps
+void timer_init(void);
+
+// sleep for ms, or until an interrupt sets *flag, returns *flag.
+// 0 returns straight away, since the timer can't count to it.
+uint8_t timer_wait(volatile uint8_t * flag, uint16_t ms);
+
+void timer_sleep_ms(uint16_t ms);
+void timer_sleep_us(uint16_t us);
+
+#endif